@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+# Dumps the log from the bob in binary and decodes it into the same CSV that
+# the 'r' command prints, a lot faster.
+# Usage: dumpData.py [--session N] [--summary L] <tty> <destination>
+#        dumpData.py [--summary L] --bin <dump> <destination>  (decode a saved dump)
+#
+# --session N only dumps session N, as listed by the bob's 's' command, or
+# the latest session with --session latest. That takes as long as the session
+# does, rather than the whole log.
+#
+# --summary L writes the summaries at level L (0: 100 ms, 1: 1 s, 2: 10 s)
+# instead of the records, as the same CSV as the 'p' command prints.
+#
+# The raw dump is also saved next to the CSV as <destination>.bin. Frames
+# that arrive with a bad CRC are left blank in both, and listed at the end,
+# when it exits with an error so the dump can be taken again. How fast the
+# dump came is printed as BENCH lines, like the firmware's bench.
+
+import struct
+import sys
+import termios
+import time
+import tty
+import zlib
+
+PAGE_SIZE = 256
+DUMP_MAGIC = b"DUMP"
+DUMP_HDR = struct.Struct("<4sIHH")  # magic, first page, pages, layout
+CRC = struct.Struct("<I")
+
+# Page layout, as in firmware/src/sampler.c. Records are packed column by
+# column; see firmware/include/pack.h. LOG_LAYOUT goes up with every change
+# to it, and dumps in any other layout are refused.
+LOG_LAYOUT = 1
+PAGE_HDR = struct.Struct("<BBHII")  # stream, count, epoch, seq, crc
+STREAM_IMU, STREAM_MAG, STREAM_BARO, STREAM_SUMMARY, STREAM_EVENT = range(5)
+COLUMNS = {
+    STREAM_IMU: "IhhhhhhH", # time, accel, gyro, missed
+    STREAM_MAG: "IhhhH",    # time, mag, missed
+    STREAM_BARO: "IIiH",    # time, pres, temp, missed
+    # time, level, accel, gyro, mag, pres, temp as [axis][min, max, mean],
+    # then records, missed and late for each sensor
+    STREAM_SUMMARY: "IH" + "h" * 27 + "III" + "iii" + "HHH" * 3,
+    STREAM_EVENT: "IHHHHH", # time, phase, IMU ODR, compass rate, baro OSR, keep
+}
+PHASES = ["ground", "pad", "boost", "coast", "descent", "landed"]
+SAMPLE_MISSED = 0x80  # Set in the status column when polls were missed
+BARO_OSRS = [4096, 2048, 1024, 512, 256, 128]
+SENSOR_COUNT = 3
+META_SESSIONS = 14  # Sessions the directory holds, as in sampler.c
+SUMMARY_HEADER = ("time, pres min, max, mean, temp min, max, mean, "
+                  "mag x min, max, mean, y..., z..., accel x min, max, mean, y..., z..., "
+                  "gyro x min, max, mean, y..., z..., "
+                  "IMU records, missed, late us, compass..., baro...\n")
+
+
+def read_exact(f, n):
+    buf = b""
+    while len(buf) < n:
+        chunk = f.read(n - len(buf))
+        if not chunk:
+            raise EOFError("dump ended part way through a frame")
+        buf += chunk
+    return buf
+
+
+def read_frames(f, bad):
+    """Yields (first page, data) for each good frame, until the end frame.
+    Frames with a bad CRC are added to bad as (first page, pages) instead.
+    Anything between frames, like leftover console output, is skipped."""
+    window = b""
+    while True:
+        # Find the start of the next frame
+        while window != DUMP_MAGIC:
+            window = (window + read_exact(f, 1))[-4:]
+        window = b""
+
+        hdr = DUMP_MAGIC + read_exact(f, DUMP_HDR.size - 4)
+        _, page, pages, layout = DUMP_HDR.unpack(hdr)
+        data = read_exact(f, pages * PAGE_SIZE)
+        (crc,) = CRC.unpack(read_exact(f, CRC.size))
+
+        if zlib.crc32(hdr + data) != crc:
+            print(f"Bad CRC in frame at page {page}, skipping it", file=sys.stderr)
+            bad.append((page, pages))
+            continue
+
+        if layout != LOG_LAYOUT:
+            sys.exit(f"The log is in layout {layout}, but this decodes layout "
+                     f"{LOG_LAYOUT}. Use the dumpData.py from the firmware "
+                     "that wrote it.")
+
+        if pages == 0:
+            return
+        yield page, data
+
+
+def unpack(columns, data, count):
+    """Unpacks count records from a page's packed data, as a list of tuples."""
+    firsts = []
+    pos = 0
+    for col in columns:
+        firsts.append(struct.unpack_from("<" + col, data, pos)[0])
+        pos += struct.calcsize(col)
+
+    widths = data[pos:pos + len(columns)]
+    bits = int.from_bytes(data[pos + len(columns):], "little")
+
+    values = []
+    for col, first, width in zip(columns, firsts, widths):
+        size = 8 * struct.calcsize(col)
+        mask = (1 << size) - 1
+        value = first & mask
+        column = [first]
+        for _ in range(count - 1):
+            zz = bits & ((1 << width) - 1)
+            bits >>= width
+            value = (value + ((zz >> 1) ^ -(zz & 1))) & mask
+            # Lower case formats are signed
+            if col.islower() and value >> (size - 1):
+                column.append(value - (1 << size))
+            else:
+                column.append(value)
+        values.append(column)
+
+    return list(zip(*values))
+
+
+def records(data):
+    """Yields (stream, fields) for every record in the pages in data. Pages
+    torn by a power cut fail their CRC and are skipped."""
+    for offset in range(0, len(data), PAGE_SIZE):
+        page = data[offset:offset + PAGE_SIZE]
+        stream, count, _, seq, crc = PAGE_HDR.unpack_from(page)
+        if stream not in COLUMNS:
+            continue
+
+        if zlib.crc32(page[PAGE_HDR.size:], zlib.crc32(page[:PAGE_HDR.size - 4])) != crc:
+            print(f"Torn page {seq}, skipping it", file=sys.stderr)
+            continue
+
+        for fields in unpack(COLUMNS[stream], page[PAGE_HDR.size:], count):
+            yield stream, fields
+
+
+def decode(data, out):
+    """Writes a CSV line for every sensor record in the pages in data. Phase
+    changes are printed to stderr, with the rates the sensors changed to."""
+    # time, status, pres, temp, mag[3], accel[3], gyro[3]
+    sample = [0] * 13
+
+    for stream, fields in records(data):
+        if stream == STREAM_SUMMARY:
+            continue
+        if stream == STREAM_EVENT:
+            t, phase, imu, mag, osr, keep = fields
+            print(f"{t} ms: {PHASES[phase] if phase < len(PHASES) else phase}, "
+                  f"IMU {imu} Hz, compass {mag} Hz, "
+                  f"baro OSR {BARO_OSRS[osr] if osr < len(BARO_OSRS) else osr}, "
+                  + (f"logging 1 in {keep}" if keep else "summaries only"),
+                  file=sys.stderr)
+            continue
+
+        sample[0] = fields[0]
+        sample[1] = stream | (SAMPLE_MISSED if fields[-1] else 0)
+        if stream == STREAM_IMU:
+            sample[7:13] = fields[1:7]
+        elif stream == STREAM_MAG:
+            sample[4:7] = fields[1:4]
+        else:
+            sample[2:4] = fields[1:3]
+        out.write(", ".join(str(x) for x in sample) + "\n")
+
+
+def decode_summaries(data, out, level):
+    """Writes a CSV line for every summary at level in the pages in data, in
+    the same columns as the 'p' command: the bucket's start time, the min, max
+    and mean of each channel in the same order as 'r', then the records,
+    missed polls and worst lateness of each sensor."""
+    out.write(SUMMARY_HEADER)
+
+    for stream, fields in records(data):
+        if stream != STREAM_SUMMARY or fields[1] != level:
+            continue
+
+        accel, gyro, mag = fields[2:11], fields[11:20], fields[20:29]
+        pres, temp = fields[29:32], fields[32:35]
+        kept = fields[35:35 + 3 * SENSOR_COUNT]
+        row = [fields[0], *pres, *temp, *mag, *accel, *gyro]
+        for i in range(SENSOR_COUNT):
+            row += kept[i::SENSOR_COUNT]
+        out.write(", ".join(str(x) for x in row) + "\n")
+
+
+def dump(path, command=b"x"):
+    """Asks the bob at path for a dump, and returns the pages it sends and
+    the frames that came with a bad CRC, as (first page, pages)."""
+    with open(path, "r+b", buffering=0) as f:
+        tty.setraw(f.fileno())
+        termios.tcflush(f.fileno(), termios.TCIFLUSH)
+
+        start = time.monotonic()
+        f.write(command)
+
+        # A session's pages don't start at the beginning of the log
+        first = None
+        pages = bytearray()
+        bad = []
+        for page, data in read_frames(f, bad):
+            if first is None:
+                first = page
+            if (page - first) * PAGE_SIZE != len(pages):
+                print(f"Missing pages before {page}", file=sys.stderr)
+                pages += b"\xff" * ((page - first) * PAGE_SIZE - len(pages))
+            pages += data
+
+        elapsed = time.monotonic() - start
+        print(f"Read {len(pages) / 1024:.0f} kiB in {elapsed:.1f} s "
+              f"({len(pages) / 1024 / max(elapsed, 1e-6):.0f} kiB/s)",
+              file=sys.stderr)
+        print(f"BENCH,dump.rate,{len(pages) / 1024 / max(elapsed, 1e-6):.3f},kiB/s\n"
+              f"BENCH,dump.bad_frames,{len(bad):.3f},frames", file=sys.stderr)
+        return bytes(pages), bad
+
+
+def session_command(session):
+    """The command that dumps session, a number or "latest"."""
+    if session == "latest":
+        return b"f."
+    n = int(session)
+    if not 0 <= n < META_SESSIONS:
+        raise ValueError(f"no session {session}")
+    return b"f" + f"{n:x}".encode()
+
+
+def main():
+    args = sys.argv[1:]
+    command = b"x"
+    level = None
+    if len(args) >= 4 and args[0] == "--summary" and args[1] in ("0", "1", "2"):
+        level = int(args[1])
+        args = args[2:]
+    if len(args) == 4 and args[0] == "--session":
+        command = session_command(args[1])
+        args = args[2:]
+
+    bad = []
+    if len(args) == 3 and args[0] == "--bin" and command == b"x":
+        with open(args[1], "rb") as f:
+            pages = f.read()
+        output = args[2]
+    elif len(args) == 2:
+        pages, bad = dump(args[0], command)
+        output = args[1]
+        with open(output + ".bin", "wb") as f:
+            f.write(pages)
+    else:
+        print("Usage: dumpData.py [--summary 0|1|2] [--session N|latest] <tty> <destination>\n"
+              "       dumpData.py [--summary 0|1|2] --bin <dump> <destination>",
+              file=sys.stderr)
+        sys.exit(1)
+
+    with open(output, "w") as out:
+        if level is None:
+            decode(pages, out)
+        else:
+            decode_summaries(pages, out, level)
+
+    if bad:
+        sys.exit("Bad CRC in the frames of pages "
+                 + ", ".join(f"{page}-{page + count - 1}" for page, count in bad)
+                 + ". They're missing from the output, so dump it again.")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+# Asks the bob for its trace ('g') and turns it into Chrome trace JSON, to
+# open in ui.perfetto.dev or chrome://tracing and see where the time went.
+# Usage: traceDump.py <tty> <destination.json>
+#        traceDump.py --text <dump> <destination.json>  (convert a saved dump)
+#
+# The text dump is also saved next to the JSON as <destination>.txt.
+#
+# Each core is a thread. Spans (getSample, programPage, ...) nest on the core
+# that ran them; I2C transfers, sensor polls and barometer conversions
+# overlap everything else, so they get tracks of their own.
+
+import json
+import sys
+import termios
+import tty
+
+CORES = 2
+
+
+def read_lines(f):
+    """Yields the lines of a trace dump from f, a binary stream, from
+    TRACE,start up to TRACE,end. Anything around them is skipped."""
+    started = False
+    line = b""
+    while True:
+        c = f.read(1)
+        if not c:
+            raise EOFError("dump ended before TRACE,end")
+        if c != b"\n":
+            line += c
+            continue
+
+        # The start can come straight after the console's escape codes.
+        text = line.decode(errors="replace").strip()
+        text = text[max(text.find("TRACE,"), 0):]
+        line = b""
+        if text == "TRACE,start":
+            started = True
+        elif text == "TRACE,end" and started:
+            return
+        elif started and text.startswith("TRACE,"):
+            yield text
+
+
+def parse(lines):
+    """Turns dump lines into (core, time us, phase, name, arg) tuples, in the
+    order each core recorded them. Times are unwrapped past 32 bits."""
+    events = []
+    last = [None] * CORES
+    wraps = [0] * CORES
+
+    for text in lines:
+        fields = text.split(",")
+        if fields[1] == "off":
+            sys.exit("Tracing is off. Build the firmware with -D TRACE_ON "
+                     "(pio run -e debug)")
+        if fields[1] == "lost":
+            print(f"Core {fields[2]} lost its oldest {fields[3]} events",
+                  file=sys.stderr)
+            continue
+
+        core, time, phase, name, arg = (int(fields[1]), int(fields[2]),
+                                        fields[3], ",".join(fields[4:-1]),
+                                        int(fields[-1]))
+        if last[core] is not None and time < last[core]:
+            wraps[core] += 1
+        last[core] = time
+        events.append((core, time + (wraps[core] << 32), phase, name, arg))
+
+    return events
+
+
+def to_chrome(events):
+    """Converts parsed events to the Chrome trace format. An end whose begin
+    was written over in the ring is dropped."""
+    out = [{"ph": "M", "name": "thread_name", "pid": 0, "tid": core,
+            "args": {"name": f"core {core}"}} for core in range(CORES)]
+    open_spans = [[] for _ in range(CORES)]
+
+    for core, time, phase, name, arg in events:
+        event = {"name": name, "ph": phase, "ts": time, "pid": 0, "tid": core}
+
+        if phase == "B":
+            open_spans[core].append(name)
+        elif phase == "E":
+            if name not in open_spans[core]:
+                continue
+            while open_spans[core].pop() != name:
+                pass
+        elif phase in "be":
+            # Matched up by name and id; I2C transfers by device address
+            event["cat"] = "async"
+            event["id"] = arg
+            if name == "i2c":
+                event["name"] = f"i2c 0x{arg:02x}"
+        else:
+            event["s"] = "t"
+            event["args"] = {"arg": arg}
+
+        out.append(event)
+
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def dump(path):
+    """Asks the bob at path for its trace, and returns the lines it sends."""
+    with open(path, "r+b", buffering=0) as f:
+        tty.setraw(f.fileno())
+        termios.tcflush(f.fileno(), termios.TCIFLUSH)
+        f.write(b"g")
+        return list(read_lines(f))
+
+
+def main():
+    args = sys.argv[1:]
+
+    if len(args) == 3 and args[0] == "--text":
+        with open(args[1], "rb") as f:
+            lines = list(read_lines(f))
+        output = args[2]
+    elif len(args) == 2:
+        lines = dump(args[0])
+        output = args[1]
+        with open(output + ".txt", "w") as f:
+            f.write("TRACE,start\n" + "\n".join(lines) + "\nTRACE,end\n")
+    else:
+        print("Usage: traceDump.py <tty> <destination.json>\n"
+              "       traceDump.py --text <dump> <destination.json>",
+              file=sys.stderr)
+        sys.exit(1)
+
+    events = parse(lines)
+    with open(output, "w") as out:
+        json.dump(to_chrome(events), out)
+    print(f"{len(events)} events", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
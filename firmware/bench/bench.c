@@ -0,0 +1,202 @@
+/* Benchmarks the sample -> pack -> flash -> read back pipeline, in place of
+ * the state machine in src/main.c. Built by the bench env on a board and the
+ * native-bench env on a PC, and prints one line per result:
+ *
+ *     BENCH,<name>,<value>,<unit>
+ *
+ * so two runs can be diffed, or a script can pick out the numbers. Each
+ * stage runs for BENCH_MS:
+ *  - sample: getSample() without logging. Per stream, the poll rate and how
+ *    long the reads were on the bus, and how long a getSample() call takes.
+ *  - log: the same with LOG_ALWAYS, then how long page programs took and
+ *    how well the records packed. This adds a session to the log.
+ *  - read: readSample() over that session, then formatting each record as
+ *    the CSV DATA_OUT prints.
+ *
+ * On a PC, time is virtual and CPU work costs none of it, so the bus and
+ * flash numbers are the models' and the per-call CPU costs are timed with
+ * the PC's clock instead. Those are only good for comparing one PC run with
+ * another. */
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "sampler.h"
+
+#ifdef BOB_SIM
+#include <time.h>
+#include "sim.h"
+#endif
+
+#define BENCH_MS 5000
+
+/* Time for CPU work, in us. On a PC, the simulator's clock only counts
+ * waiting, so this is the PC's own. */
+static uint64_t cpuMicros(void) {
+#ifdef BOB_SIM
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return time_us_64();
+#endif
+}
+
+static void result(const char * name, double value, const char * unit) {
+    printf("BENCH,%s,%.3f,%s\n", name, value, unit);
+}
+
+static void streamResult(const char * stream, const char * name, double value,
+                         const char * unit) {
+    printf("BENCH,%s.%s,%.3f,%s\n", stream, name, value, unit);
+}
+
+/* Calls getSample() for BENCH_MS and reports how long each call took. */
+static void runSampler(sample_t * sample, enum log_mode mode, const char * stage) {
+    uint64_t end = time_us_64() + BENCH_MS * 1000;
+    uint64_t calls = 0;
+    uint64_t total = 0;
+    uint64_t worst = 0;
+    uint64_t start;
+    uint64_t took;
+    absolute_time_t next;
+    char name[32];
+
+    while (time_us_64() < end) {
+        start = cpuMicros();
+        next = getSample(sample, mode);
+        took = cpuMicros() - start;
+
+        calls++;
+        total += took;
+        worst = MAX(worst, took);
+
+        if (mode != LOG_NONE)
+            eraseAhead(false);
+        best_effort_wfe_or_timeout(next);
+    }
+
+    snprintf(name, sizeof(name), "%s.get_calls", stage);
+    result(name, calls, "calls");
+    snprintf(name, sizeof(name), "%s.get_mean", stage);
+    result(name, calls ? (double) total / calls : 0, "us");
+    snprintf(name, sizeof(name), "%s.get_max", stage);
+    result(name, worst, "us");
+}
+
+/* Per stream: how often it was polled, how long its reads were on the bus,
+ * and whether it kept up. */
+static void samplerResults(const struct sampler_stats * stats) {
+    char stream[24];
+    uint8_t i;
+
+    for (i = 0; i < SENSOR_COUNT; i++) {
+        snprintf(stream, sizeof(stream), "sample.%s", stats->streams[i].name);
+        streamResult(stream, "rate", stats->streams[i].polls * 1000.0 / BENCH_MS, "Hz");
+        streamResult(stream, "busy_mean", stats->streams[i].polls ?
+                     (double) stats->streams[i].totalBusy / stats->streams[i].polls : 0, "us");
+        streamResult(stream, "busy_max", stats->streams[i].maxBusy, "us");
+        streamResult(stream, "late_max", stats->streams[i].maxLate, "us");
+        streamResult(stream, "late_p99", stats->streams[i].p99Late, "us");
+        streamResult(stream, "overruns", stats->streams[i].overruns, "polls");
+    }
+}
+
+/* Page programs, and how well each stream packed. */
+static void logResults(const struct sampler_stats * stats) {
+    char stream[24];
+    uint8_t i;
+
+    result("log.pages", stats->programs, "pages");
+    result("log.program_mean", stats->programs ?
+           (double) stats->totalProgram / stats->programs : 0, "us");
+    result("log.program_max", stats->maxProgram, "us");
+    result("log.program_fails", stats->programFails, "pages");
+    result("log.pages_lost", stats->pagesLost, "pages");
+
+    for (i = 0; i < SENSOR_COUNT; i++) {
+        snprintf(stream, sizeof(stream), "log.%s", stats->streams[i].name);
+        streamResult(stream, "records", stats->streams[i].records, "records");
+        streamResult(stream, "records_per_page", stats->streams[i].pages ?
+                     (double) stats->streams[i].records / stats->streams[i].pages : 0,
+                     "records");
+        streamResult(stream, "dropped", stats->streams[i].dropped, "records");
+    }
+}
+
+/* Reads the latest session back, timing readSample() and formatting the
+ * records as DATA_OUT does separately. Nothing is printed but the results,
+ * so USB doesn't get counted. */
+static void readBack(void) {
+    struct log_cursor cursor;
+    sample_t sample = { 0 };
+    char line[SAMPLE_CSV_MAX];
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t readTime = 0;
+    uint64_t formatTime = 0;
+    uint64_t start;
+
+    if (!seekTime(&cursor, SESSION_LATEST, 0, UINT32_MAX)) {
+        printf("BENCH,error,0,no session to read back\n");
+        return;
+    }
+
+    while (true) {
+        start = cpuMicros();
+        if (readSample(&cursor, &sample))
+            break;
+        readTime += cpuMicros() - start;
+
+        start = cpuMicros();
+        bytes += formatSample(line, sizeof(line), &sample);
+        formatTime += cpuMicros() - start;
+        records++;
+    }
+
+    result("read.records", records, "records");
+    result("read.mean", records ? (double) readTime / records : 0, "us");
+    result("read.rate", readTime ? records * 1e6 / readTime : 0, "records/s");
+    result("format.mean", records ? (double) formatTime / records : 0, "us");
+    result("format.bytes", records ? (double) bytes / records : 0, "bytes");
+}
+
+int main() {
+    struct sampler_stats stats;
+    sample_t sample = { 0 };
+
+    stdio_init_all();
+    while (!stdio_usb_connected())
+        sleep_ms(100);
+
+    configureSensors();
+
+#ifdef BOB_SIM
+    printf("BENCH,platform,0,host\n");
+#else
+    printf("BENCH,platform,0,rp2040\n");
+#endif
+    result("bench_ms", BENCH_MS, "ms");
+
+    resetStats();
+    runSampler(&sample, LOG_NONE, "sample");
+    getStats(&stats);
+    samplerResults(&stats);
+
+    resetStats();
+    runSampler(&sample, LOG_ALWAYS, "log");
+    flushSamples();
+    getStats(&stats);
+    logResults(&stats);
+
+    readBack();
+    printf("BENCH,done,0,\n");
+    stdio_flush();
+
+#ifdef BOB_SIM
+    SimEnd();
+#endif
+    while (true)
+        sleep_ms(1000);
+}
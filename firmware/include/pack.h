@@ -0,0 +1,68 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Packs runs of records into a compact, column by column block.
+ *
+ * Each column is stored as the first record's value, followed by the
+ * difference between each record and the one before. The differences are
+ * zigzag encoded, so small negative ones stay small, and bit packed at the
+ * width the largest one needs. Sensor readings change slowly compared to
+ * their range, so most columns pack down to a handful of bits a record.
+ *
+ * A block is laid out as:
+ *   first value of each column, at the column's own size
+ *   width in bits of each column's differences, one byte each
+ *   each column's differences in turn, packed LSB first */
+
+#define PACK_MAX_COLUMNS 48
+#define PACK_MAX_RECORDS 128
+
+// A field in a record. Fields are signed or unsigned 16 or 32 bit integers.
+struct column {
+    uint8_t offset;   // Where the field is in the record
+    uint8_t size;     // 2 or 4 bytes
+};
+
+#define COLUMN(type, field) \
+    { offsetof(type, field), sizeof(((type *)0)->field) }
+
+// How a type of record is split into columns.
+struct layout {
+    const struct column * columns;
+    uint8_t count;    // Number of columns
+    uint8_t size;     // sizeof the record
+};
+
+// A block being filled.
+struct packer {
+    const struct layout * layout;
+    uint16_t space;   // Size of the block in bytes
+    uint8_t count;    // Records in the block so far
+    uint8_t capacity; // Most records the block can take
+    uint8_t width[PACK_MAX_COLUMNS];
+    uint8_t * records; // Room for capacity records
+};
+
+/* Sets up packer to fill blocks of space bytes with records laid out as
+ * layout. records must have room for capacity of them, which is at most
+ * PACK_MAX_RECORDS. */
+void packInit(struct packer * packer, const struct layout * layout,
+              uint16_t space, void * records, uint8_t capacity);
+
+/* Adds a record to the block, if it fits.
+ * Returns true if it was added, or false if the block is full. */
+bool packAdd(struct packer * packer, const void * record);
+
+/* Writes out the block, and empties the packer for the next one.
+ * buf must hold space bytes. Returns the number of records in the block. */
+uint8_t packWrite(struct packer * packer, uint8_t * buf);
+
+/* Unpacks count records from a block written by packWrite into records. */
+void unpack(const struct layout * layout, const uint8_t * buf,
+            uint8_t count, void * records);
+
+#endif
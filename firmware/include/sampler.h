@@ -4,9 +4,91 @@
 #include <pico/stdlib.h>
 #include <stdint.h>
 
+// Each sensor is polled at its own rate and logged as its own stream.
+// Summaries of them are logged as another, and events as another still.
+enum streams {
+    STREAM_IMU  = 0,
+    STREAM_MAG  = 1,
+    STREAM_BARO = 2,
+    SENSOR_COUNT,              // Streams before this are sensors
+    STREAM_SUMMARY = SENSOR_COUNT,
+    STREAM_EVENT,
+    STREAM_COUNT
+};
+
+// Where we are in a flight. Each phase polls the sensors at its own rates.
+enum flight_phase {
+    PHASE_GROUND,  // Plugged in, or logging by hand
+    PHASE_PAD,     // Waiting for launch
+    PHASE_BOOST,
+    PHASE_COAST,
+    PHASE_DESCENT,
+    PHASE_LANDED,
+    PHASE_COUNT
+};
+
+/* Records, as they are stored in flash. Each page only holds records from
+ * one stream. */
+typedef struct {
+    uint32_t time;    // Time since boot in ms
+    int16_t accel[3]; // Raw IMU output X, Y, Z;
+    int16_t gyro[3];
+    uint16_t missed;  // Polls missed just before this record. Almost always
+                      // 0, which packs down to nothing
+} imu_record_t;
+
+typedef struct {
+    uint32_t time;
+    int16_t mag[3];   // Raw magentometer output X, Y, Z;
+    uint16_t missed;
+} mag_record_t;
+
+typedef struct {
+    uint32_t time;
+    uint32_t pres;    // Pressure in pascals
+    int32_t temp;     // Temperature in centidegrees.
+    uint16_t missed;
+} baro_record_t;
+
+/* The min, max and mean of every channel over a bucket of time. Kept at
+ * a few resolutions as the log is written, to preview a flight with. */
+#define SUMMARY_LEVELS 3
+
+typedef struct {
+    uint32_t time;        // Start of the bucket, since boot in ms
+    uint16_t level;       // 0: 100 ms buckets, 1: 1 s, 2: 10 s
+    int16_t accel[3][3];  // [axis][min, max, mean]
+    int16_t gyro[3][3];
+    int16_t mag[3][3];
+    uint32_t pres[3];     // min, max, mean
+    int32_t temp[3];
+    // How each sensor kept time over the bucket, to check its rate held
+    uint16_t records[SENSOR_COUNT]; // Records it made, logged or not
+    uint16_t missed[SENSOR_COUNT];  // Polls it missed entirely
+    uint16_t late[SENSOR_COUNT];    // Worst time a poll started late, in us
+} summary_record_t;
+
+/* Logged when the phase changes, with the rates the sensors are set to
+ * from then on, and when the log starts keeping fewer records as it fills
+ * up. A session that logs before launch starts with one for the pad; until
+ * the first one, the rates are the ground ones and every record is kept. */
 typedef struct {
-    uint8_t status;
     uint32_t time;    // Time since boot in ms
+    uint16_t phase;   // The new phase
+    uint16_t imuOdr;  // IMU samples a second
+    uint16_t magRate; // Compass reads a second
+    uint16_t baroOsr; // HP203_OSR_*
+    uint16_t keep;    // One in this many sensor records is logged, 0 for none
+} event_record_t;
+
+// Set in a sample's status when polls were missed just before the update
+#define SAMPLE_MISSED 0x80
+
+/* The latest reading from every sensor. */
+typedef struct {
+    uint8_t status;   // Stream that was last updated, and SAMPLE_MISSED
+    uint32_t time;    // Time of the last update, since boot in ms
+    uint64_t micros;  // The same in us. Read back from flash, it's time * 1000
 
     uint32_t pres;    // Pressure in pascals
     int32_t temp;     // Temperature in centidegrees.
@@ -17,26 +99,140 @@ typedef struct {
     int16_t gyro[3];
 } sample_t;
 
+// Pass to dumpSession() for the most recent session.
+#define SESSION_LATEST 0xFF
+// Never a session, so anything passed it finds no such session
+#define SESSION_NONE   0xFE
+
+// What eraseAhead() returns when it isn't part way through erasing
+#define ERASE_DONE    -1
+#define ERASE_SKIPPED -2
+#define ERASE_FAILED  -3
+
+// Keeps track of where we are when reading the log back.
+struct log_cursor {
+    uint32_t page;
+    uint8_t record;
+    uint32_t end;     // Page to stop at
+    uint32_t from;    // Only records from this time up to to are read, in ms
+    uint32_t to;
+};
+
 /* Takes a sample and a message and prints it to the console in
  * a nice pretty format */
 void prettyPrint(sample_t s, char * msg);
 
+// Longest line formatSample() writes, with the newline and terminator
+#define SAMPLE_CSV_MAX 160
+
+/* Writes s into buf as a line of the CSV 'r' prints, newline and all.
+ * Returns the length of the line, as snprintf() does. */
+int formatSample(char * buf, size_t len, const sample_t * s);
+
+/* Timing stats since boot or the last resetStats(), for the benchmarks in
+ * bench/ and anything else that wants numbers rather than the debug prompt.
+ * Times are in us. */
+struct sampler_stats {
+    struct {
+        const char * name;
+        uint32_t polls;
+        uint32_t overruns;   // Polls missed entirely
+        uint32_t maxLate;    // Worst time a poll started after it was due
+        uint32_t p99Late;    // 99% of polls started later than due by less
+        uint32_t maxBusy;    // Worst time a poll's reads took to finish
+        uint64_t totalBusy;  // All of them added up
+        uint32_t records;    // Records logged, and the pages they took up
+        uint32_t pages;
+        uint32_t dropped;    // Records dropped because core 0 fell behind
+    } streams[SENSOR_COUNT];
+    uint32_t programs;       // Page programs, including failed ones
+    uint32_t programFails;   // Programs the flash didn't finish, and were retried
+    uint32_t pagesLost;      // Pages dropped because failed ones filled the staging ring
+    uint32_t maxProgram;     // Longest page program
+    uint64_t totalProgram;   // All of them added up
+};
+
+/* Copies the timing stats into stats. */
+void getStats(struct sampler_stats * stats);
+
+/* Zeroes the timing stats. Core 1 keeps updating the stream stats while
+ * this runs, so a poll that finishes at the same time may be lost. */
+void resetStats(void);
+
 /* Initialises the sensors and the associated i2c bus */
 void configureSensors(void);
 
-/* Gets a sample from the sensors.
+// How getSample() logs what it reads.
+enum log_mode {
+    LOG_NONE,   // Don't log anything
+    LOG_ALWAYS, // Log everything to flash
+    LOG_LAUNCH  // Keep the last few seconds in SRAM until launch is detected,
+                // then log them and everything after to flash
+};
+
+/* Polls whichever sensors are due and updates sample with their readings,
+ * and logs them as set by mode.
  * No longer attempts to determine if sensors are functional.
- * If they don't respond, they dont respond. */
-sample_t getSample(void);
+ * If they don't respond, they dont respond.
+ * Returns the time the next sensor is due. Reads in progress finish with an
+ * interrupt, so wait with best_effort_wfe_or_timeout() rather than sleeping. */
+absolute_time_t getSample(sample_t * sample, enum log_mode mode);
+
+/* Programs any partially filled pages to flash.
+ * Call this before you stop logging, or the last few records are lost.
+ * If launch was never detected, the pages kept in SRAM are thrown away. */
+void flushSamples(void);
+
+/* Points cursor at the start of the log, to read all of it. */
+void seekLog(struct log_cursor * cursor);
+
+/* Points cursor at the records in session n (or the latest, if n is
+ * SESSION_LATEST) from time from up to time to, in ms since boot. Finds them
+ * with a binary search over the page headers, so reading a range costs
+ * about log2(pages) reads plus the pages in it, not the whole log.
+ * Returns false if there's no such session. */
+bool seekTime(struct log_cursor * cursor, uint8_t n, uint32_t from, uint32_t to);
 
-/* Writes a sample to flash.
- * No longer faffs around with buffering. Just yheets it onto flash. */
-void logSample(sample_t sample);
+/* Reads the record at cursor from flash and applies it to sample,
+ * then moves cursor on to the next record.
+ * Returns 0 on success, or 1 if there are no more records. */
+uint8_t readSample(struct log_cursor * cursor, sample_t * sample);
 
-/* Reads a sample from flash */
-uint8_t readSample (size_t index, sample_t * sample);
+/* Sends every page in the log over USB as binary frames, for
+ * drivers/dumpData.py to decode. */
+void dumpFlash(void);
 
-/* Clears the flash */
+/* Prints the summaries of session n (or the latest, if n is SESSION_LATEST)
+ * at level, as CSV: the bucket's start time, then the min, max and mean of
+ * each channel in the same order as 'r'. A flight at 1 s resolution is a
+ * few hundred lines, to pick out which part is worth reading in full.
+ * Returns false if there's no such session. */
+bool previewSession(uint8_t n, uint8_t level);
+
+/* Prints the session directory: where each session is in the log, how many
+ * records it has, when it started and how the sensors were set up. A session
+ * starts each time logging does. */
+void listSessions(void);
+
+/* Sends just the pages of session n, or the latest one if n is
+ * SESSION_LATEST, in the same frames as dumpFlash(). Costs time in
+ * proportion to the session, however much else is in the log.
+ * If there's no such session, only the end frame is sent.
+ * Returns false if there's no such session. */
+bool dumpSession(uint8_t n);
+
+/* Starts a new log. Returns straight away; the old log is erased bit by bit
+ * by eraseAhead(). */
 void clearFlash(void);
 
+/* Erases the next sector ahead of the write cursor, if it needs it.
+ * While logging, this stays a little ahead of the cursor; with all set it
+ * carries on until the rest of the flash is blank. Only does one sector a
+ * call, so it can be run between other work.
+ * Returns how much of the flash is blank ahead of the log, in percent, or:
+ * ERASE_DONE if it's erased as far as it needs to be.
+ * ERASE_SKIPPED if the next sector was already blank, so wasn't erased.
+ * ERASE_FAILED if the flash didn't take the erase. It's tried again next call. */
+int8_t eraseAhead(bool all);
+
 #endif
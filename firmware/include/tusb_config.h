@@ -11,7 +11,8 @@
 
 #define CFG_TUD_CDC             (1)
 #define CFG_TUD_CDC_RX_BUFSIZE  (256)
-#define CFG_TUD_CDC_TX_BUFSIZE  (256)
+// Big enough that dumpFlash() can queue a whole frame's worth of packets.
+#define CFG_TUD_CDC_TX_BUFSIZE  (4096)
 
 // We use a vendor specific interface but with our own driver
 #define CFG_TUD_VENDOR            (0)
@@ -74,16 +74,52 @@ int8_t HP203Test(hp203_t *sensor)
     HP203_ERROR_GENERIC for other errors */
 int32_t HP203Measure(hp203_t *sensor, enum HP203_CHN channel, enum HP203_OSR OSR)
 {
-    static const uint32_t timeLookup[7] =
+    uint8_t command = HP203_ADC_SET
+                      | OSR << HP203_OSR_SHIFT
+                      | channel;
+
+    int i2cState = HP203SendCommand(sensor, command);
+
+    return i2cState == 1 ? HP203MeasureTime(channel, OSR) : i2cState;
+}
+
+/*  Returns the time a measurement takes in us */
+uint32_t __not_in_flash_func(HP203MeasureTime)(enum HP203_CHN channel, enum HP203_OSR OSR)
+{
+    static const uint32_t __not_in_flash("hp203") timeLookup[7] =
     {131100, 65600, 32800, 16400, 8200, 4100, 2100};
 
+    return timeLookup[channel + OSR];
+}
+
+/*  Fills in xfer to start a measurement, for use with I2CQSubmit.
+    Does the same as HP203Measure; use HP203MeasureTime to find out when
+    the measurement will be done. */
+void __not_in_flash_func(HP203MeasureXfer)(hp203_t *sensor, struct i2cq_xfer *xfer,
+                                           enum HP203_CHN channel, enum HP203_OSR OSR)
+{
     uint8_t command = HP203_ADC_SET
                       | OSR << HP203_OSR_SHIFT
                       | channel;
 
-    int i2cState = HP203SendCommand(sensor, command);
+    I2CQXfer(xfer, HP203_ADDR, &command, 1, NULL, 0);
+}
+
+/*  Fills in xfer to read pressure and temperature into buf, for use with
+    I2CQSubmit. buf must hold HP203_DATA_LEN bytes. Once the transfer is
+    done, use HP203ParseData to get the result. */
+void __not_in_flash_func(HP203GetDataXfer)(hp203_t *sensor, struct i2cq_xfer *xfer, uint8_t *buf)
+{
+    uint8_t command = HP203_READ_PT;
+    I2CQXfer(xfer, HP203_ADDR, &command, 1, buf, HP203_DATA_LEN);
+}
 
-    return i2cState == 1 ? timeLookup[channel + OSR] : i2cState;
+/*  Turns the bytes read by HP203GetDataXfer into pascals and centidegrees */
+void __not_in_flash_func(HP203ParseData)(const uint8_t *buf, struct hp203_data *result)
+{
+    result->pres = buf[5] | buf[4] << 8 | buf[3] << 16;
+    result->temp = buf[2] | buf[1] << 8 | buf[0] << 16;
+    result->temp |= result->temp & 1 << 20 ? 0xFFF00000 : 0;
 }
 
 /*  Gets the pressure. Must be ran after a measurement has finished
@@ -142,18 +178,13 @@ int8_t HP203GetTemp(hp203_t *sensor, int32_t *result)
     HP203_ERROR_GENERIC for other errors */
 int8_t HP203GetData(hp203_t *sensor, struct hp203_data *result)
 {
-    uint8_t buffer[6];
+    uint8_t buffer[HP203_DATA_LEN];
     int i2cState[2];
 
     i2cState[0] = HP203SendCommand(sensor, HP203_READ_PT);
-    i2cState[1] = HP203ReadBytes(sensor, buffer, 6);
+    i2cState[1] = HP203ReadBytes(sensor, buffer, HP203_DATA_LEN);
 
-    if(true)
-    {
-        result->pres = buffer[5] | buffer[4] << 8 | buffer[3] << 16;
-        result->temp = buffer[2] | buffer[1] << 8 | buffer[0] << 16;
-        result->temp |= result->temp & 1 << 20 ? 0xFFF00000 : 0;
-    }
+    HP203ParseData(buffer, result);
 
     // Return the worst bad error.
     return i2cState[0] < i2cState[1] ?
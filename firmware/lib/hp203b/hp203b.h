@@ -16,9 +16,11 @@
 
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
+#include "i2cq.h"
 
 #define HP203_ADDR 	0x76
 #define HP203_TIMEOUT	1000
+#define HP203_DATA_LEN	6	// Bytes read by HP203GetData
 
 // HP203 Commands
 #define HP203_RESET	0x06
@@ -92,6 +94,23 @@ int8_t HP203Test(hp203_t *sensor);
     HP203_ERROR_GENERIC for other errors */
 int32_t HP203Measure(hp203_t *sensor, enum HP203_CHN channel, enum HP203_OSR OSR);
 
+/*  Returns the time a measurement takes in us */
+uint32_t HP203MeasureTime(enum HP203_CHN channel, enum HP203_OSR OSR);
+
+/*  Fills in xfer to start a measurement, for use with I2CQSubmit.
+    Does the same as HP203Measure; use HP203MeasureTime to find out when
+    the measurement will be done. */
+void HP203MeasureXfer(hp203_t *sensor, struct i2cq_xfer *xfer,
+                      enum HP203_CHN channel, enum HP203_OSR OSR);
+
+/*  Fills in xfer to read pressure and temperature into buf, for use with
+    I2CQSubmit. buf must hold HP203_DATA_LEN bytes. Once the transfer is
+    done, use HP203ParseData to get the result. */
+void HP203GetDataXfer(hp203_t *sensor, struct i2cq_xfer *xfer, uint8_t *buf);
+
+/*  Turns the bytes read by HP203GetDataXfer into pascals and centidegrees */
+void HP203ParseData(const uint8_t *buf, struct hp203_data *result);
+
 /*  Gets the pressure. Must be ran after a measurement has finished
     Returns:
     HP203_OK on success,
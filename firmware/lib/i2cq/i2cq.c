@@ -0,0 +1,290 @@
+#include "i2cq.h"
+#include "trace.h"
+
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+
+// There's only one bus on Bob, so the queue is a singleton.
+static i2c_inst_t *bus;
+static uint txChan;
+static uint rxChan;
+
+// Ring of chains waiting to run, and the transfer currently on the bus
+static struct i2cq_xfer *queue[I2CQ_DEPTH];
+static volatile uint8_t head = 0;
+static volatile uint8_t tail = 0;
+static struct i2cq_xfer *volatile active = NULL;
+
+// Words for IC_DATA_CMD. Reads need a command word per byte too.
+static uint32_t cmds[I2CQ_MAX_CMDS];
+
+/*  Puts a transfer on the bus. Interrupts must be disabled.
+    Returns false, leaving the bus alone, if it doesn't fit in cmds. A done
+    callback can change rxLen after I2CQSubmit checked it. */
+static bool __not_in_flash_func(I2CQStart)(struct i2cq_xfer *xfer)
+{
+    i2c_hw_t *hw = i2c_get_hw(bus);
+    size_t n = 0;
+    size_t i;
+
+    if(xfer->txLen + xfer->rxLen == 0 || xfer->txLen + xfer->rxLen > I2CQ_MAX_CMDS)
+        return false;
+
+    for(i = 0; i < xfer->txLen; i++)
+        cmds[n++] = xfer->tx[i];
+
+    for(i = 0; i < xfer->rxLen; i++)
+    {
+        cmds[n++] = I2C_IC_DATA_CMD_CMD_BITS
+                    | (i == 0 && xfer->txLen ? I2C_IC_DATA_CMD_RESTART_BITS : 0);
+    }
+
+    cmds[n - 1] |= I2C_IC_DATA_CMD_STOP_BITS;
+    active = xfer;
+    TRACE_ASYNC_BEGIN("i2c", xfer->addr);
+
+    // The target address can only be changed while the block is disabled.
+    hw->enable = 0;
+    hw->tar = xfer->addr;
+    hw->enable = 1;
+
+    // Throw away anything left over from a previous transfer.
+    (void) hw->clr_intr;
+    hw->intr_mask = I2C_IC_INTR_MASK_M_STOP_DET_BITS
+                    | I2C_IC_INTR_MASK_M_TX_ABRT_BITS;
+
+    if(xfer->rxLen)
+    {
+        dma_channel_set_write_addr(rxChan, xfer->rx, false);
+        dma_channel_set_trans_count(rxChan, xfer->rxLen, true);
+    }
+
+    dma_channel_set_read_addr(txChan, cmds, false);
+    dma_channel_set_trans_count(txChan, n, true);
+    return true;
+}
+
+/* Fails every transfer left in a chain */
+static void __not_in_flash_func(I2CQFailChain)(struct i2cq_xfer *xfer, int8_t status)
+{
+    while((xfer = xfer->next) != NULL && xfer->status == I2CQ_PENDING)
+    {
+        xfer->status = status;
+        if(xfer->done)
+            xfer->done(xfer);
+    }
+}
+
+/* Fails a transfer that couldn't be started, and the rest of its chain */
+static void __not_in_flash_func(I2CQFail)(struct i2cq_xfer *xfer, int8_t status)
+{
+    xfer->status = status;
+    if(xfer->done)
+        xfer->done(xfer);
+    I2CQFailChain(xfer, status);
+}
+
+/* Starts the next chain in the queue, if there is one. Interrupts must be disabled. */
+static void __not_in_flash_func(I2CQNext)(void)
+{
+    struct i2cq_xfer *xfer;
+
+    while(active == NULL && tail != head)
+    {
+        xfer = queue[tail];
+        tail = (tail + 1) % I2CQ_DEPTH;
+        if(!I2CQStart(xfer))
+            I2CQFail(xfer, I2CQ_ERROR_GENERIC);
+    }
+}
+
+static void __not_in_flash_func(I2CQIrq)(void)
+{
+    i2c_hw_t *hw = i2c_get_hw(bus);
+    struct i2cq_xfer *xfer = active;
+    uint32_t stat = hw->intr_stat;
+    uint32_t start;
+    int8_t status;
+
+    if(stat & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
+    {
+        dma_channel_abort(txChan);
+        dma_channel_abort(rxChan);
+
+        // The controller still sends a stop after an abort. Wait for it, or
+        // it can land once the next transfer has started and be taken for
+        // that one finishing.
+        start = timer_hw->timerawl;
+        while(!(hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_STOP_DET_BITS)
+              && hw->status & I2C_IC_STATUS_MST_ACTIVITY_BITS
+              && timer_hw->timerawl - start < I2CQ_ABORT_US)
+            tight_loop_contents();
+
+        (void) hw->clr_tx_abrt;
+        (void) hw->clr_stop_det;
+        status = I2CQ_ERROR_GENERIC;
+    }
+    else if(stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS)
+    {
+        (void) hw->clr_stop_det;
+
+        // The last byte can still be on its way out of the RX FIFO.
+        while(dma_channel_is_busy(rxChan))
+            tight_loop_contents();
+
+        status = I2CQ_OK;
+    }
+    else
+    {
+        return;
+    }
+
+    hw->intr_mask = 0;
+    active = NULL;
+
+    if(xfer == NULL)
+        return;
+
+    TRACE_ASYNC_END("i2c", xfer->addr);
+    if(status != I2CQ_OK)
+        TRACE_MARK("i2c abort", xfer->addr);
+
+    xfer->status = status;
+    if(xfer->done)
+        xfer->done(xfer);
+
+    if(status != I2CQ_OK)
+        I2CQFailChain(xfer, status);
+    else if(xfer->next != NULL)
+    {
+        xfer->next->status = I2CQ_PENDING;
+        if(I2CQStart(xfer->next))
+            return;
+        I2CQFail(xfer->next, I2CQ_ERROR_GENERIC);
+    }
+
+    I2CQNext();
+}
+
+/*  Sets up the DMA channels and IRQ for the queue on i2c.
+    The bus itself should be initialised with i2c_init() first. */
+void I2CQInit(i2c_inst_t *i2c)
+{
+    i2c_hw_t *hw = i2c_get_hw(i2c);
+    uint index = i2c_hw_index(i2c);
+    dma_channel_config cfg;
+
+    bus = i2c;
+    txChan = dma_claim_unused_channel(true);
+    rxChan = dma_claim_unused_channel(true);
+
+    // Command words go out to IC_DATA_CMD as whole words, data comes back
+    // from it a byte at a time.
+    cfg = dma_channel_get_default_config(txChan);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+    channel_config_set_read_increment(&cfg, true);
+    channel_config_set_write_increment(&cfg, false);
+    channel_config_set_dreq(&cfg, DREQ_I2C0_TX + 2 * index);
+    dma_channel_configure(txChan, &cfg, &hw->data_cmd, cmds, 0, false);
+
+    cfg = dma_channel_get_default_config(rxChan);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+    channel_config_set_read_increment(&cfg, false);
+    channel_config_set_write_increment(&cfg, true);
+    channel_config_set_dreq(&cfg, DREQ_I2C0_RX + 2 * index);
+    dma_channel_configure(rxChan, &cfg, NULL, &hw->data_cmd, 0, false);
+
+    hw->dma_tdlr = 4;
+    hw->dma_rdlr = 0;
+    hw->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS | I2C_IC_DMA_CR_RDMAE_BITS;
+
+    // Only unmasked while a transfer is running, so the blocking SDK
+    // functions can still be used while the queue is empty.
+    hw->intr_mask = 0;
+    irq_set_exclusive_handler(I2C0_IRQ + index, I2CQIrq);
+    irq_set_enabled(I2C0_IRQ + index, true);
+}
+
+/*  Fills in a transfer that writes len bytes from tx, then reads rxLen bytes
+    into rx. Clears done and next. */
+void __not_in_flash_func(I2CQXfer)(struct i2cq_xfer *xfer, uint8_t addr,
+                                   const uint8_t *tx, uint8_t txLen,
+                                   uint8_t *rx, uint16_t rxLen)
+{
+    uint8_t i;
+
+    xfer->addr = addr;
+    xfer->txLen = MIN(txLen, I2CQ_TX_MAX);
+    for(i = 0; i < xfer->txLen; i++)
+        xfer->tx[i] = tx[i];
+
+    xfer->rx = rx;
+    xfer->rxLen = rxLen;
+    xfer->status = I2CQ_OK;
+    xfer->done = NULL;
+    xfer->next = NULL;
+}
+
+/*  Queues a chain of transfers.
+    Returns:
+    I2CQ_OK if it was queued.
+    I2CQ_ERROR_FULL if the queue is full.
+    I2CQ_ERROR_GENERIC if a transfer in the chain is too big or empty. */
+int8_t __not_in_flash_func(I2CQSubmit)(struct i2cq_xfer *xfer)
+{
+    struct i2cq_xfer *x;
+    uint32_t ints;
+    uint8_t next;
+
+    for(x = xfer; x != NULL; x = x->next)
+    {
+        if(x->txLen + x->rxLen == 0 || x->txLen + x->rxLen > I2CQ_MAX_CMDS)
+            return I2CQ_ERROR_GENERIC;
+        if(x->next == x)
+            break;
+    }
+
+    ints = save_and_disable_interrupts();
+    next = (head + 1) % I2CQ_DEPTH;
+
+    if(next == tail)
+    {
+        restore_interrupts(ints);
+        return I2CQ_ERROR_FULL;
+    }
+
+    for(x = xfer; x != NULL && x->status != I2CQ_PENDING; x = x->next)
+        x->status = I2CQ_PENDING;
+
+    queue[head] = xfer;
+    head = next;
+    I2CQNext();
+
+    restore_interrupts(ints);
+    return I2CQ_OK;
+}
+
+/* Returns true if anything is queued or in progress */
+bool __not_in_flash_func(I2CQBusy)(void)
+{
+    return active != NULL || tail != head;
+}
+
+/*  Waits for the queue to empty, for up to timeout us.
+    Returns:
+    I2CQ_OK once the queue is empty.
+    I2CQ_ERROR_TIMEOUT if it hasn't emptied in time. */
+int8_t I2CQWait(uint32_t timeout)
+{
+    absolute_time_t until = make_timeout_time_us(timeout);
+
+    while(I2CQBusy())
+    {
+        if(time_reached(until))
+            return I2CQ_ERROR_TIMEOUT;
+        tight_loop_contents();
+    }
+
+    return I2CQ_OK;
+}
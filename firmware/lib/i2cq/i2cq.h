@@ -0,0 +1,84 @@
+/*  Queued, DMA driven I2C transfers.
+    Transfers are described by an i2cq_xfer and submitted to a queue. Each
+    one is run by the DMA, and an IRQ picks up when it finishes and starts
+    the next one, so the CPU is free while the bus is busy.
+
+    Transfers can be chained using next; the chain runs back to back, and a
+    done callback can edit the rest of the chain before it runs.
+
+    Don't use the blocking i2c_* functions on the same bus while anything is
+    queued. I2CQWait() until the queue is empty first.
+
+    Everything but I2CQInit() and I2CQWait() runs from RAM, so transfers can
+    be queued and finished while flash is being programmed. */
+
+#ifndef I2CQ_H
+#define I2CQ_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pico/stdlib.h"
+#include "hardware/i2c.h"
+
+#define I2CQ_DEPTH    8     // Most chains that can be queued at once
+#define I2CQ_TX_MAX   2     // Most bytes a transfer can write
+#define I2CQ_MAX_CMDS 1024  // Most bytes a transfer can move in total
+#define I2CQ_TIMEOUT  10000 // Default time to wait in I2CQWait, in us
+#define I2CQ_ABORT_US 100   // Most time to wait for the stop after an abort
+
+// Status codes. These line up with PICO_ERROR_TIMEOUT and PICO_ERROR_GENERIC
+#define I2CQ_PENDING        1 // Queued or in progress
+#define I2CQ_OK             0
+#define I2CQ_ERROR_TIMEOUT -1
+#define I2CQ_ERROR_GENERIC -2 // Usually the device didn't ACK
+#define I2CQ_ERROR_FULL    -3 // Queue is full
+
+struct i2cq_xfer
+{
+    uint8_t addr;
+    uint8_t txLen;
+    uint16_t rxLen;
+    uint8_t tx[I2CQ_TX_MAX];  // Written first, usually a register address
+    uint8_t *rx;              // Read after a repeated start
+
+    volatile int8_t status;
+
+    /*  Called from the IRQ once the transfer finishes, before the next one in
+        the chain starts. May be NULL. Setting next to the transfer itself
+        runs it again, which can be used to poll a register. If it leaves
+        the next transfer too big to run, that one fails with
+        I2CQ_ERROR_GENERIC. */
+    void (*done)(struct i2cq_xfer *xfer);
+    void *ctx;                // For use by the callback
+
+    struct i2cq_xfer *next;   // Next transfer in the chain, or NULL
+};
+
+/*  Sets up the DMA channels and IRQ for the queue on i2c.
+    The bus itself should be initialised with i2c_init() first. */
+void I2CQInit(i2c_inst_t *i2c);
+
+/*  Fills in a transfer that writes len bytes from tx, then reads rxLen bytes
+    into rx. Clears done and next. */
+void I2CQXfer(struct i2cq_xfer *xfer, uint8_t addr,
+              const uint8_t *tx, uint8_t txLen, uint8_t *rx, uint16_t rxLen);
+
+/*  Queues a chain of transfers.
+    Returns:
+    I2CQ_OK if it was queued.
+    I2CQ_ERROR_FULL if the queue is full.
+    I2CQ_ERROR_GENERIC if a transfer in the chain is too big or empty. */
+int8_t I2CQSubmit(struct i2cq_xfer *xfer);
+
+/* Returns true if anything is queued or in progress */
+bool I2CQBusy(void);
+
+/*  Waits for the queue to empty, for up to timeout us.
+    Returns:
+    I2CQ_OK once the queue is empty.
+    I2CQ_ERROR_TIMEOUT if it hasn't emptied in time. */
+int8_t I2CQWait(uint32_t timeout);
+
+#endif
@@ -159,20 +159,53 @@ int8_t QMCGetCfg(qmc_t *sensor)
     QMC_ERROR_GENERIC for other errors */
 int8_t QMCGetMag(qmc_t *sensor, int16_t *data)
 {
-    uint8_t buffer[6];
-    int8_t i2cState = QMCReadBytes(sensor, QMC_XOUT_LSB, 6, buffer);
+    uint8_t buffer[QMC_MAG_LEN];
+    int8_t i2cState = QMCReadBytes(sensor, QMC_XOUT_LSB, QMC_MAG_LEN, buffer);
 
-    if(i2cState == 6)
+    if(i2cState == QMC_MAG_LEN)
     {
-        data[0] = buffer[0] | (buffer[1] << 8);
-        data[1] = buffer[2] | (buffer[3] << 8);
-        data[2] = buffer[4] | (buffer[5] << 8);
+        QMCParseMag(buffer, data);
+        return QMC_OK;
     }
 
     return i2cState == QMC_ERROR_TIMEOUT ?
            QMC_ERROR_TIMEOUT : QMC_ERROR_GENERIC;
 }
 
+/*  Fills in xfer to read the magnetometer into buf, for use with I2CQSubmit.
+    buf must hold QMC_MAG_LEN bytes. Once the transfer is done, use
+    QMCParseMag to get the result. */
+void __not_in_flash_func(QMCGetMagXfer)(qmc_t *sensor, struct i2cq_xfer *xfer, uint8_t *buf)
+{
+    uint8_t reg = QMC_XOUT_LSB;
+    I2CQXfer(xfer, QMC_ADDR, &reg, 1, buf, QMC_MAG_LEN);
+}
+
+/*  Fills in xfer to change the ODR, keeping the rest of the config set by
+    QMCSetCfg, for use with I2CQSubmit. */
+void __not_in_flash_func(QMCSetODRXfer)(qmc_t *sensor, struct i2cq_xfer *xfer, enum QMCODR ODR)
+{
+    uint8_t buf[2];
+
+    sensor->config.ODR = ODR;
+    sensor->config.control[0] = sensor->config.mode    << QMC_MODE_SHIFT
+                                | ODR                  << QMC_ODR_SHIFT
+                                | sensor->config.OSR   << QMC_OSR_SHIFT
+                                | sensor->config.scale << QMC_SCALE_SHIFT;
+
+    buf[0] = QMC_CONTROL1;
+    buf[1] = sensor->config.control[0];
+    I2CQXfer(xfer, QMC_ADDR, buf, 2, NULL, 0);
+}
+
+/*  Turns the bytes read by QMCGetMagXfer into a 3 long array */
+void __not_in_flash_func(QMCParseMag)(const uint8_t *buf, int16_t *data)
+{
+    data[0] = buf[0] | (buf[1] << 8);
+    data[1] = buf[2] | (buf[3] << 8);
+    data[2] = buf[4] | (buf[5] << 8);
+}
+
 /*  Reads temperature from the magnetometer and stores it in result
     Returns:
     QMC_OK if successful.
@@ -5,6 +5,7 @@
 
 #include <pico/stdlib.h>
 #include <hardware/i2c.h>
+#include <i2cq.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -76,6 +77,7 @@ enum QMCOSR {              // OverSample Ratio; how many samples should be
 // I2C constants
 #define QMC_ADDR     0x0D
 #define QMC_TIMEOUT  1000
+#define QMC_MAG_LEN  6    // Bytes read by QMCGetMag
 
 struct qmc_cfg {          // Used for quick setting/analysis of QMC settings.
     enum QMCMode mode;
@@ -145,6 +147,18 @@ int8_t QMCGetCfg(qmc_t * sensor);
  * QMC_ERROR_GENERIC for other errors */
 int8_t QMCGetMag(qmc_t * sensor, int16_t * data);
 
+/* Fills in xfer to read the magnetometer into buf, for use with I2CQSubmit.
+ * buf must hold QMC_MAG_LEN bytes. Once the transfer is done, use
+ * QMCParseMag to get the result. */
+void QMCGetMagXfer(qmc_t * sensor, struct i2cq_xfer * xfer, uint8_t * buf);
+
+/* Fills in xfer to change the ODR, keeping the rest of the config set by
+ * QMCSetCfg, for use with I2CQSubmit. */
+void QMCSetODRXfer(qmc_t * sensor, struct i2cq_xfer * xfer, enum QMCODR ODR);
+
+/* Turns the bytes read by QMCGetMagXfer into a 3 long array */
+void QMCParseMag(const uint8_t * buf, int16_t * data);
+
 /* Reads temperature from the magnetometer and stores it in result
  * Returns:
  * QMC_OK if successful.
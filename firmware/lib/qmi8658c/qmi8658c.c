@@ -1,48 +1,73 @@
 #include "qmi8658c.h"
+#include "hardware/divider.h"
 
 static int8_t QMIWriteByte(qmi_t *qmi, enum QMIRegister reg, uint8_t value)
 {
     uint8_t buf[2] = {reg, value};
-    i2c_write_timeout_per_char_us(qmi->i2c, qmi->addr, buf,
-                                  2, false, QMI_TIMEOUT);
+    int i2cState = i2c_write_timeout_per_char_us(qmi->i2c, qmi->addr, buf,
+                                                 2, false, QMI_TIMEOUT);
+    return i2cState < 0 ? i2cState : QMI_OK;
 }
 
 static int8_t QMIReadBytes(qmi_t *qmi, enum QMIRegister reg, uint8_t *buffer, size_t len)
 {
     uint8_t buf = reg;
-    uint8_t i2cState[2];
-    uint32_t i;
+    int i2cState[2];
 
-    // The QMI is supposed to autoincrement register pointers.
-    // It does not. :(
-    for(i = 0; i < len; i++)
-    {
-        i2cState[0] = i2c_write_timeout_per_char_us(qmi->i2c, qmi->addr,
-                      &buf, 1, false,
-                      QMI_TIMEOUT);
-        i2cState[1] = i2c_read_timeout_per_char_us(qmi->i2c, qmi->addr,
-                      buffer + i, 1, false,
-                      QMI_TIMEOUT);
-
-        if(i2cState[0] < 0 && i2cState[1] < 0)
-        {
-            return i2cState[0] < i2cState[1] ?
-                   i2cState[0] : i2cState[1];
-        }
+    // With QMI_ADDR_AI set the register pointer auto-increments, so the whole
+    // block comes back in one transaction.
+    i2cState[0] = i2c_write_timeout_per_char_us(qmi->i2c, qmi->addr,
+                  &buf, 1, true,
+                  QMI_TIMEOUT);
+    i2cState[1] = i2c_read_timeout_per_char_us(qmi->i2c, qmi->addr,
+                  buffer, len, false,
+                  QMI_TIMEOUT);
 
-        buf++;
+    if(i2cState[0] < 0 || i2cState[1] < 0)
+    {
+        return i2cState[0] < i2cState[1] ?
+               i2cState[0] : i2cState[1];
     }
 
     return 0;
 }
 
-/*  Generates a QMI_T struct.
+/*  Sends a command over CTRL9 and waits for the QMI to finish it */
+static int8_t QMICommand(qmi_t *qmi, enum QMICommand cmd)
+{
+    uint8_t status = 0;
+    int8_t i2cStatus = QMIWriteByte(qmi, QMI_CTRL_CMD, cmd);
+    uint32_t i;
+
+    for(i = 0; i < QMI_CMD_TRIES && i2cStatus == QMI_OK; i++)
+    {
+        i2cStatus = QMIReadBytes(qmi, QMI_STATUSINT, &status, 1);
+        if(status & QMI_CMD_DONE)
+            break;
+    }
+
+    if(i2cStatus != QMI_OK)
+        return i2cStatus;
+    else if(!(status & QMI_CMD_DONE))
+        return QMI_ERROR_TIMEOUT;
+
+    // Acknowledging clears CmdDone, ready for the next command.
+    return QMIWriteByte(qmi, QMI_CTRL_CMD, QMI_CMD_ACK);
+}
+
+/*  Generates a QMI_T struct, and turns on register address auto-increment.
     SA0 is used to set the address, on Bob this should be set to false. */
 qmi_t QMIInit(i2c_inst_t *i2c, bool SA0)
 {
     qmi_t qmi;
     qmi.i2c = i2c;
     qmi.addr = QMI_ADDR | SA0;
+    qmi.fifoCtrl = QMI_FIFO_BYPASS;
+    qmi.fifoFrame = 0;
+    qmi.fifoSensors = 0;
+
+    // Little endian, so the LSB registers come first in a burst.
+    QMIWriteByte(&qmi, QMI_CTRL_IF, QMI_ADDR_AI);
     return qmi;
 }
 
@@ -148,6 +173,22 @@ int8_t QMIGyroConfig(qmi_t *qmi, enum QMIGyroODR odr, enum QMIGyroScale scl)
     return i2cStatus == QMI_OK ? buf : i2cStatus;
 }
 
+/*  Fill in xfer to do the same as QMIAccConfig and QMIGyroConfig, for use
+    with I2CQSubmit, so the ODR can be changed while the queue is running. */
+void __not_in_flash_func(QMIAccConfigXfer)(qmi_t *qmi, struct i2cq_xfer *xfer,
+                                           enum QMIAccelODR odr, enum QMIAccelScale scl)
+{
+    const uint8_t buf[2] = {QMI_CTRL_ACC, (scl << QMI_SCALE_OFFSET) | odr};
+    I2CQXfer(xfer, qmi->addr, buf, 2, NULL, 0);
+}
+
+void __not_in_flash_func(QMIGyroConfigXfer)(qmi_t *qmi, struct i2cq_xfer *xfer,
+                                            enum QMIGyroODR odr, enum QMIGyroScale scl)
+{
+    const uint8_t buf[2] = {QMI_CTRL_GYRO, (scl << QMI_SCALE_OFFSET) | odr};
+    I2CQXfer(xfer, qmi->addr, buf, 2, NULL, 0);
+}
+
 /*  Reads the data off the QMI and writes it to data
     Returns:
     QMI_OK if successful.
@@ -175,6 +216,239 @@ int8_t QMIReadData(qmi_t *qmi, struct qmi_data *data)
     return i2cStatus;
 }
 
+/*  Works out how many whole samples are in the FIFO, from FIFO_SMPL_CNT and
+    FIFO_STATUS. These count the data in the FIFO in 2 byte words.
+    Uses the divider directly, as the usual division routines live in flash. */
+static size_t __not_in_flash_func(QMIFifoCount)(qmi_t *qmi, const uint8_t *count, size_t len)
+{
+    size_t bytes = 2 * (count[0] | (count[1] & 0x03) << 8);
+    size_t n = MIN(hw_divider_u32_quotient_inlined(bytes, qmi->fifoFrame), len);
+    return MIN(n, QMI_FIFO_MAX);
+}
+
+/*  Unpacks n samples read out of the FIFO. Each holds accel then gyro, or
+    only whichever of them is enabled; the other is zeroed. */
+static void __not_in_flash_func(QMIFifoUnpack)(qmi_t *qmi, const uint8_t *buf,
+                                              struct qmi_data *data, size_t n)
+{
+    const uint8_t *frame;
+    size_t i;
+    uint8_t j;
+
+    for(i = 0; i < n; i++)
+    {
+        frame = buf + i * qmi->fifoFrame;
+        data[i].timestamp = 0;
+        data[i].temp = 0;
+
+        for(j = 0; j < 3; j++)
+        {
+            data[i].accel[j] = 0;
+            data[i].gyro[j] = 0;
+        }
+
+        if(qmi->fifoSensors & QMI_ACC_ENABLE)
+        {
+            data[i].accel[0] = frame[0] | frame[1] << 8;
+            data[i].accel[1] = frame[2] | frame[3] << 8;
+            data[i].accel[2] = frame[4] | frame[5] << 8;
+            frame += 6;
+        }
+
+        if(qmi->fifoSensors & QMI_GYRO_ENABLE)
+        {
+            data[i].gyro[0] = frame[0] | frame[1] << 8;
+            data[i].gyro[1] = frame[2] | frame[3] << 8;
+            data[i].gyro[2] = frame[4] | frame[5] << 8;
+        }
+    }
+}
+
+/*  Configures the FIFO. Sensors should be enabled and configured first, as
+    the FIFO only holds data from enabled sensors. The watermark is in samples.
+    Returns:
+    QMI_OK if successful.
+    QMI_ERROR_TIMEOUT if the I2C timesout.
+    QMI_ERROR_GENERIC for other errors */
+int8_t QMIFifoConfig(qmi_t *qmi, enum QMIFifoMode mode, enum QMIFifoSize size, uint8_t watermark)
+{
+    uint8_t CTRL7;
+    int8_t i2cStatus = QMIReadBytes(qmi, QMI_CTRL_ENB, &CTRL7, 1);
+
+    if(i2cStatus != QMI_OK)
+        return i2cStatus;
+
+    // Each enabled sensor adds 6 bytes to a sample, accel first.
+    qmi->fifoSensors = CTRL7 & (QMI_ACC_ENABLE | QMI_GYRO_ENABLE);
+    qmi->fifoFrame = (CTRL7 & QMI_ACC_ENABLE ? 6 : 0)
+                     + (CTRL7 & QMI_GYRO_ENABLE ? 6 : 0);
+    qmi->fifoCtrl = size << QMI_FIFO_SIZE_SHIFT | mode;
+
+    i2cStatus = QMIWriteByte(qmi, QMI_FIFO_WTM_TH, watermark);
+    if(i2cStatus == QMI_OK)
+        i2cStatus = QMIWriteByte(qmi, QMI_FIFO_CTRL, qmi->fifoCtrl);
+    if(i2cStatus == QMI_OK)
+        i2cStatus = QMICommand(qmi, QMI_CMD_RST_FIFO);
+
+    return i2cStatus;
+}
+
+/*  Drains up to len samples from the FIFO into data, in a single burst.
+    Only accel and gyro are filled in; the FIFO doesn't hold timestamps.
+    Whichever of them wasn't enabled when the FIFO was configured is 0.
+    Returns:
+    The number of samples read if successful.
+    QMI_ERROR_TIMEOUT if the I2C timesout.
+    QMI_ERROR_GENERIC for other errors */
+int16_t QMIFifoRead(qmi_t *qmi, struct qmi_data *data, size_t len)
+{
+    static uint8_t buf[QMI_FIFO_MAX * 12];
+    uint8_t count[2];
+    size_t n;
+    int8_t i2cStatus;
+
+    if(qmi->fifoFrame == 0)
+        return 0;
+
+    i2cStatus = QMIReadBytes(qmi, QMI_FIFO_SMPL_CNT, count, 2);
+    if(i2cStatus != QMI_OK)
+        return i2cStatus;
+
+    n = QMIFifoCount(qmi, count, len);
+    if(n == 0)
+        return 0;
+
+    // The FIFO has to be put into read mode before it can be read, and taken
+    // out of it again afterwards. FIFO_DATA doesn't auto-increment.
+    i2cStatus = QMICommand(qmi, QMI_CMD_REQ_FIFO);
+    if(i2cStatus == QMI_OK)
+        i2cStatus = QMIReadBytes(qmi, QMI_FIFO_DATA, buf, n * qmi->fifoFrame);
+    QMIWriteByte(qmi, QMI_FIFO_CTRL, qmi->fifoCtrl);
+
+    if(i2cStatus != QMI_OK)
+        return i2cStatus;
+
+    QMIFifoUnpack(qmi, buf, data, n);
+    return n;
+}
+
+/* Callbacks for each step of QMIFifoReadAsync. These run in the I2C IRQ. */
+static void __not_in_flash_func(QMIFifoCountDone)(struct i2cq_xfer *xfer)
+{
+    struct qmi_fifo_read *rd = xfer->ctx;
+
+    if(xfer->status != I2CQ_OK)
+        return;
+
+    rd->n = QMIFifoCount(rd->qmi, rd->count, rd->len);
+    rd->xfer[4].rxLen = rd->n * rd->qmi->fifoFrame;
+
+    if(rd->n == 0)
+    {
+        // Nothing to read, so we can stop here.
+        xfer->next = NULL;
+        rd->result = 0;
+    }
+}
+
+static void __not_in_flash_func(QMIFifoStatusDone)(struct i2cq_xfer *xfer)
+{
+    struct qmi_fifo_read *rd = xfer->ctx;
+
+    // Keep polling STATUSINT until the QMI says it is ready to be read
+    if(xfer->status == I2CQ_OK && !(rd->status & QMI_CMD_DONE) && rd->tries-- > 0)
+        xfer->next = xfer;
+    else
+        xfer->next = &rd->xfer[3];
+}
+
+static void __not_in_flash_func(QMIFifoCtrlDone)(struct i2cq_xfer *xfer)
+{
+    struct qmi_fifo_read *rd = xfer->ctx;
+
+    if(xfer->status != I2CQ_OK)
+        rd->result = xfer->status;
+    else if(!(rd->status & QMI_CMD_DONE))
+        rd->result = QMI_ERROR_TIMEOUT;
+    else
+        rd->result = rd->n;
+}
+
+/*  Starts draining up to len samples from the FIFO using the I2C queue.
+    The data comes out in one transfer, so it can be no more than the queue
+    can move at once: 85 samples of accel and gyro, or 170 of one.
+    rd->result is QMI_PENDING until it finishes, then is the same as the
+    return value of QMIFifoRead. Use QMIFifoParse to get the samples.
+    Returns:
+    QMI_OK if it was queued.
+    QMI_ERROR_GENERIC if the queue is full. */
+int8_t __not_in_flash_func(QMIFifoReadAsync)(qmi_t *qmi, struct qmi_fifo_read *rd, size_t len)
+{
+    const uint8_t countReg = QMI_FIFO_SMPL_CNT;
+    const uint8_t request[2] = {QMI_CTRL_CMD, QMI_CMD_REQ_FIFO};
+    const uint8_t statusReg = QMI_STATUSINT;
+    const uint8_t ack[2] = {QMI_CTRL_CMD, QMI_CMD_ACK};
+    const uint8_t dataReg = QMI_FIFO_DATA;
+    const uint8_t ctrl[2] = {QMI_FIFO_CTRL, qmi->fifoCtrl};
+    uint8_t i;
+
+    rd->qmi = qmi;
+    rd->len = MIN(len, QMI_FIFO_MAX);
+    rd->n = 0;
+    rd->status = 0;
+    rd->tries = QMI_CMD_TRIES;
+
+    if(qmi->fifoFrame == 0)
+    {
+        rd->result = 0;
+        return QMI_OK;
+    }
+
+    // The data transfer has to fit in the queue's commands along with the
+    // register address, or the queue refuses it.
+    rd->len = MIN(rd->len, hw_divider_u32_quotient_inlined(I2CQ_MAX_CMDS - 1, qmi->fifoFrame));
+
+    // Same steps as QMIFifoRead, but chained together on the queue.
+    I2CQXfer(&rd->xfer[0], qmi->addr, &countReg, 1, rd->count, 2);
+    I2CQXfer(&rd->xfer[1], qmi->addr, request, 2, NULL, 0);
+    I2CQXfer(&rd->xfer[2], qmi->addr, &statusReg, 1, &rd->status, 1);
+    I2CQXfer(&rd->xfer[3], qmi->addr, ack, 2, NULL, 0);
+    I2CQXfer(&rd->xfer[4], qmi->addr, &dataReg, 1, rd->buf, 0);
+    I2CQXfer(&rd->xfer[5], qmi->addr, ctrl, 2, NULL, 0);
+
+    for(i = 0; i < 6; i++)
+    {
+        rd->xfer[i].ctx = rd;
+        rd->xfer[i].next = i < 5 ? &rd->xfer[i + 1] : NULL;
+    }
+
+    rd->xfer[0].done = QMIFifoCountDone;
+    rd->xfer[2].done = QMIFifoStatusDone;
+    rd->xfer[5].done = QMIFifoCtrlDone;
+
+    // Give it a non-zero length for now, so it passes the size check.
+    rd->xfer[4].rxLen = 1;
+
+    rd->result = QMI_PENDING;
+    if(I2CQSubmit(&rd->xfer[0]) != I2CQ_OK)
+    {
+        rd->result = QMI_ERROR_GENERIC;
+        return QMI_ERROR_GENERIC;
+    }
+
+    return QMI_OK;
+}
+
+/*  Copies the samples from a finished QMIFifoReadAsync into data.
+    Returns the number of samples, or the error the read failed with. */
+int16_t __not_in_flash_func(QMIFifoParse)(struct qmi_fifo_read *rd, struct qmi_data *data)
+{
+    if(rd->result > 0)
+        QMIFifoUnpack(rd->qmi, rd->buf, data, rd->result);
+
+    return rd->result;
+}
+
 /* Takes a raw accelerometer reading and returns a value in G */
 float QMIAccG(int16_t accel, enum QMIAccelScale scl)
 {
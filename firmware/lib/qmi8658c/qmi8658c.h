@@ -7,6 +7,7 @@
 
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
+#include "i2cq.h"
 
 /*  A libary for operating the QMI8658C IMU from QST Corporation
     Does not support Attitude Engine or Magnetometer integration.*/
@@ -17,12 +18,20 @@ enum QMIRegister
     QMI_WHO_AM_I = 0x00,       // Should contain 0x05
 
     // Settings registers
+    QMI_CTRL_IF = 0x02,        // Serial interface settings
     QMI_CTRL_ACC = 0x03,       // Accelerometer settings
     QMI_CTRL_GYRO = 0x04,      // Gyro settings
     QMI_CTRL_LPF = 0x06,       // Low pass filter settings
     QMI_CTRL_ENB = 0x08,       // Enable sensors
     QMI_CTRL_CMD = 0x0A,       // Host commands
 
+    // FIFO registers
+    QMI_FIFO_WTM_TH = 0x13,    // FIFO watermark, in samples
+    QMI_FIFO_CTRL = 0x14,      // FIFO settings
+    QMI_FIFO_SMPL_CNT = 0x15,  // Amount of data in the FIFO, LSB
+    QMI_FIFO_STATUS = 0x16,    // FIFO flags and the MSB of the count
+    QMI_FIFO_DATA = 0x17,
+
     // Status registers
     QMI_STATUSINT = 0x2D,      // Sensor data availability
     QMI_STATUS0 = 0x2E,        // Output data overrun
@@ -56,6 +65,10 @@ enum QMIRegister
 
 #define QMI_SCALE_OFFSET 4
 
+// Settings for the CTRL1 register
+#define QMI_ADDR_AI (1 << 6)   // Auto-increment register address on reads
+#define QMI_BE      (1 << 5)   // Read data big endian
+
 enum QMIAccelScale
 {
     QMI_ACC_2G  = 0x00,
@@ -118,6 +131,33 @@ enum QMIOpt
     QMI_SYNC_SMPL   = 1 << 7
 };
 
+// Commands that can be written to CTRL9
+enum QMICommand
+{
+    QMI_CMD_ACK      = 0x00,
+    QMI_CMD_RST_FIFO = 0x04,
+    QMI_CMD_REQ_FIFO = 0x05
+};
+
+enum QMIFifoMode
+{
+    QMI_FIFO_BYPASS = 0x00,    // FIFO disabled
+    QMI_FIFO_FIFO   = 0x01,    // Stops filling once full
+    QMI_FIFO_STREAM = 0x02     // Overwrites the oldest samples once full
+};
+
+enum QMIFifoSize
+{
+    QMI_FIFO_16  = 0x00,
+    QMI_FIFO_32  = 0x01,
+    QMI_FIFO_64  = 0x02,
+    QMI_FIFO_128 = 0x03
+};
+
+#define QMI_FIFO_SIZE_SHIFT 2
+#define QMI_FIFO_RD_MODE (1 << 7)
+#define QMI_CMD_DONE     (1 << 7)  // In STATUSINT
+
 // Status codes
 enum QMIStatus
 {
@@ -127,16 +167,22 @@ enum QMIStatus
     QMI_OK             =  0,
     QMI_ERROR_TIMEOUT  = -1,
     QMI_ERROR_GENERIC  = -2,
-    QMI_ERROR_BAD_CONF = -3
+    QMI_ERROR_BAD_CONF = -3,
+    QMI_PENDING        = -4  // Negative, as a FIFO read's result is a sample count
 };
 
 #define QMI_ADDR 0x6A       // Can be changed to 0x6B by pulling SA0 high.
 #define QMI_TIMEOUT 1000    // This hasnt been done on Bob, but its worth noting
+#define QMI_CMD_TRIES 100   // Number of times to check if a command is done
+#define QMI_FIFO_MAX 128    // Most samples the FIFO can hold
 
 typedef struct
 {
     i2c_inst_t *i2c;
     uint8_t addr;
+    uint8_t fifoCtrl;       // Value of FIFO_CTRL set by QMIFifoConfig
+    uint8_t fifoFrame;      // Bytes per sample in the FIFO
+    uint8_t fifoSensors;    // QMI_ACC_ENABLE/QMI_GYRO_ENABLE, as the FIFO was set up
 } qmi_t;
 
 // The QMI really wants you to take big reads. Its kinda weird tbh.
@@ -148,7 +194,22 @@ struct qmi_data
     int16_t gyro[3];
 };
 
-/*  Generates a QMI_T struct.
+/*  Everything needed to drain the FIFO without blocking, see QMIFifoReadAsync.
+    Must stay put until result is no longer QMI_PENDING. */
+struct qmi_fifo_read
+{
+    qmi_t *qmi;
+    struct i2cq_xfer xfer[6];
+    uint8_t count[2];
+    uint8_t status;
+    uint8_t tries;
+    size_t len;
+    int16_t n;
+    volatile int16_t result;
+    uint8_t buf[QMI_FIFO_MAX * 12];
+};
+
+/*  Generates a QMI_T struct, and turns on register address auto-increment.
     SA0 is used to set the address, on Bob this should be set to false. */
 qmi_t QMIInit(i2c_inst_t *i2c, bool SA0);
 
@@ -194,6 +255,13 @@ int8_t QMIAccConfig(qmi_t *qmi, enum QMIAccelODR odr, enum QMIAccelScale scl);
     QMI_ERROR_GENERIC for other errors */
 int8_t QMIGyroConfig(qmi_t *qmi, enum QMIGyroODR odr, enum QMIGyroScale scl);
 
+/*  Fill in xfer to do the same as QMIAccConfig and QMIGyroConfig, for use
+    with I2CQSubmit, so the ODR can be changed while the queue is running. */
+void QMIAccConfigXfer(qmi_t *qmi, struct i2cq_xfer *xfer,
+                      enum QMIAccelODR odr, enum QMIAccelScale scl);
+void QMIGyroConfigXfer(qmi_t *qmi, struct i2cq_xfer *xfer,
+                       enum QMIGyroODR odr, enum QMIGyroScale scl);
+
 /*  Reads the data off the QMI and writes it to data
     Returns:
     QMI_OK if successful.
@@ -201,6 +269,37 @@ int8_t QMIGyroConfig(qmi_t *qmi, enum QMIGyroODR odr, enum QMIGyroScale scl);
     QMI_ERROR_GENERIC for other errors */
 int8_t QMIReadData(qmi_t *qmi, struct qmi_data *data);
 
+/*  Configures the FIFO. Sensors should be enabled and configured first, as
+    the FIFO only holds data from enabled sensors. The watermark is in samples.
+    Returns:
+    QMI_OK if successful.
+    QMI_ERROR_TIMEOUT if the I2C timesout.
+    QMI_ERROR_GENERIC for other errors */
+int8_t QMIFifoConfig(qmi_t *qmi, enum QMIFifoMode mode, enum QMIFifoSize size, uint8_t watermark);
+
+/*  Drains up to len samples from the FIFO into data, in a single burst.
+    Only accel and gyro are filled in; the FIFO doesn't hold timestamps.
+    Whichever of them wasn't enabled when the FIFO was configured is 0.
+    Returns:
+    The number of samples read if successful.
+    QMI_ERROR_TIMEOUT if the I2C timesout.
+    QMI_ERROR_GENERIC for other errors */
+int16_t QMIFifoRead(qmi_t *qmi, struct qmi_data *data, size_t len);
+
+/*  Starts draining up to len samples from the FIFO using the I2C queue.
+    The data comes out in one transfer, so it can be no more than the queue
+    can move at once: 85 samples of accel and gyro, or 170 of one.
+    rd->result is QMI_PENDING until it finishes, then is the same as the
+    return value of QMIFifoRead. Use QMIFifoParse to get the samples.
+    Returns:
+    QMI_OK if it was queued.
+    QMI_ERROR_GENERIC if the queue is full. */
+int8_t QMIFifoReadAsync(qmi_t *qmi, struct qmi_fifo_read *rd, size_t len);
+
+/*  Copies the samples from a finished QMIFifoReadAsync into data.
+    Returns the number of samples, or the error the read failed with. */
+int16_t QMIFifoParse(struct qmi_fifo_read *rd, struct qmi_data *data);
+
 /* Takes a raw reading from the gyro and returns a value in dps */
 float QMIGyroDPS(int16_t gyro, enum QMIGyroScale scl);
 
@@ -0,0 +1,90 @@
+#include "trace.h"
+
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include <assert.h>
+
+#ifdef TRACE_ON
+
+static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0, "TRACE_EVENTS must be a power of 2");
+
+/* One ring per core, so each only has one writer. head counts every event
+   ever recorded; the ring holds the last TRACE_EVENTS of them. */
+static struct
+{
+    struct trace_event events[TRACE_EVENTS];
+    volatile uint32_t head;
+} rings[TRACE_CORES];
+
+static volatile bool tracing = true;
+
+/*  Records an event on the calling core's ring. Use the TRACE_* macros
+    rather than calling this directly. */
+void __not_in_flash_func(TraceRecord)(const char *name, char phase, uint16_t arg)
+{
+    struct trace_event *e;
+    uint32_t ints;
+    uint32_t n;
+    uint core;
+
+    if(!tracing)
+        return;
+
+    // An interrupt on this core could record an event of its own part way
+    // through. The division in % lives in flash, so mask instead.
+    ints = save_and_disable_interrupts();
+    core = get_core_num();
+    n = rings[core].head;
+    e = &rings[core].events[n & (TRACE_EVENTS - 1)];
+    e->time = timer_hw->timerawl;
+    e->name = name;
+    e->arg = arg;
+    e->phase = phase;
+    rings[core].head = n + 1;
+    restore_interrupts(ints);
+}
+
+/*  Prints both rings to stdout, oldest event first, then empties them.
+    Recording stops while it runs. */
+void TraceDump(void)
+{
+    const struct trace_event *e;
+    uint32_t head;
+    uint32_t i;
+    uint8_t core;
+
+    // An event the other core is part way through recording can still
+    // land, and be dumped next time.
+    tracing = false;
+
+    printf("TRACE,start\n");
+    for(core = 0; core < TRACE_CORES; core++)
+    {
+        head = rings[core].head;
+        i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+        if(i > 0)
+            printf("TRACE,lost,%u,%lu\n", core, (unsigned long) i);
+
+        for(; i < head; i++)
+        {
+            e = &rings[core].events[i & (TRACE_EVENTS - 1)];
+            printf("TRACE,%u,%lu,%c,%s,%u\n", core, (unsigned long) e->time,
+                   e->phase, e->name, e->arg);
+        }
+
+        rings[core].head = 0;
+    }
+    printf("TRACE,end\n");
+
+    tracing = true;
+}
+
+#else
+
+/*  Says tracing is off, in the same frame as a dump. */
+void TraceDump(void)
+{
+    printf("TRACE,start\nTRACE,off\nTRACE,end\n");
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*  Timestamped trace events, kept in a ring in SRAM, for seeing where the
+    time goes on a real board.
+
+    Each event is the time in us, a name, a phase and a 16 bit argument. The
+    phases are the ones Chrome's trace viewer and Perfetto use, so a dump can
+    be turned straight into their JSON by drivers/traceDump.py:
+        TRACE_BEGIN/TRACE_END    A span on the core that records it. Spans
+                                 on one core must nest.
+        TRACE_ASYNC_BEGIN/_END   A span that can overlap others, or start
+                                 on one core and end on the other, matched
+                                 up by name and arg.
+        TRACE_MARK               A single point in time.
+
+    Only a pointer to the name is kept, so names must be string literals (or
+    live for as long as the program does). Each core has its own ring, and
+    recording an event only holds interrupts off for a few cycles, so
+    neither core waits on the other. Once a ring is full the oldest events
+    are written over.
+
+    Everything but TraceDump() runs from RAM, so events can be recorded on
+    core 1 and while flash is busy.
+
+    Tracing is only built with -D TRACE_ON, as the debug env does. Without
+    it the macros compile to nothing, so the libraries that use them cost
+    nothing for it, and TraceDump() just says it's off. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pico/stdlib.h"
+
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 1024   // Events kept for each core. Must be a power of 2
+#endif
+
+#define TRACE_CORES 2
+
+// Phases, as Chrome's trace format spells them
+#define TRACE_PH_BEGIN       'B'
+#define TRACE_PH_END         'E'
+#define TRACE_PH_MARK        'i'
+#define TRACE_PH_ASYNC_BEGIN 'b'
+#define TRACE_PH_ASYNC_END   'e'
+
+#ifdef TRACE_ON
+#define TRACE_BEGIN(name)            TraceRecord(name, TRACE_PH_BEGIN, 0)
+#define TRACE_END(name)              TraceRecord(name, TRACE_PH_END, 0)
+#define TRACE_MARK(name, arg)        TraceRecord(name, TRACE_PH_MARK, arg)
+#define TRACE_ASYNC_BEGIN(name, arg) TraceRecord(name, TRACE_PH_ASYNC_BEGIN, arg)
+#define TRACE_ASYNC_END(name, arg)   TraceRecord(name, TRACE_PH_ASYNC_END, arg)
+#else
+#define TRACE_BEGIN(name)            ((void) 0)
+#define TRACE_END(name)              ((void) 0)
+#define TRACE_MARK(name, arg)        ((void) 0)
+#define TRACE_ASYNC_BEGIN(name, arg) ((void) 0)
+#define TRACE_ASYNC_END(name, arg)   ((void) 0)
+#endif
+
+struct trace_event
+{
+    uint32_t time;      // Low 32 bits of the time since boot, in us
+    const char *name;
+    uint16_t arg;
+    char phase;         // TRACE_PH_*
+};
+
+/*  Records an event on the calling core's ring. Use the TRACE_* macros
+    rather than calling this directly. */
+void TraceRecord(const char *name, char phase, uint16_t arg);
+
+/*  Prints both rings to stdout, oldest event first, then empties them.
+    Recording stops while it runs. The dump is text, one line each:
+        TRACE,start
+        TRACE,lost,<core>,<events written over>
+        TRACE,<core>,<time us>,<phase>,<name>,<arg>
+        TRACE,end
+    Times are the low 32 bits of the timer, so they wrap every 71 minutes.
+    Built without TRACE_ON, there's a single TRACE,off line in between. */
+void TraceDump(void);
+
+#endif
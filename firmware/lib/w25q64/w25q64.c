@@ -0,0 +1,188 @@
+#include "w25q64.h"
+#include "trace.h"
+
+// Commands are built up here. Kept out of the stack, as a page is big.
+static uint8_t txBuf[4 + W25Q_PAGE_SIZE];
+static uint8_t rxBuf[4 + W25Q_PAGE_SIZE];
+
+/*  Creates a W25Q struct that sends commands with cmd and tells time with
+    micros. */
+w25q_t W25QInit(void (*cmd)(const uint8_t *tx, uint8_t *rx, size_t count),
+                uint32_t (*micros)(void))
+{
+    w25q_t flash;
+    flash.cmd = cmd;
+    flash.micros = micros;
+    flash.erasing = W25Q_IDLE;
+    return flash;
+}
+
+/* Sends a command with no address or data */
+static void __not_in_flash_func(W25QCommand)(w25q_t *flash, uint8_t command)
+{
+    txBuf[0] = command;
+    flash->cmd(txBuf, rxBuf, 1);
+}
+
+/* Sends a command with an address, followed by len bytes already in txBuf */
+static void __not_in_flash_func(W25QAddrCommand)(w25q_t *flash, uint8_t command,
+                                                 uint32_t offset, size_t len)
+{
+    txBuf[0] = command;
+    txBuf[1] = offset >> 16;
+    txBuf[2] = offset >> 8;
+    txBuf[3] = offset;
+    flash->cmd(txBuf, rxBuf, 4 + len);
+}
+
+/*  Reads a status register, W25Q_READ_SR1 or W25Q_READ_SR2 */
+uint8_t __not_in_flash_func(W25QStatus)(w25q_t *flash, uint8_t reg)
+{
+    txBuf[0] = reg;
+    txBuf[1] = 0;
+    flash->cmd(txBuf, rxBuf, 2);
+    return rxBuf[1];
+}
+
+/* Waits up to us microseconds for the chip to stop being busy */
+static bool __not_in_flash_func(W25QWaitReady)(w25q_t *flash, uint32_t us)
+{
+    uint32_t start = flash->micros();
+
+    while(W25QStatus(flash, W25Q_READ_SR1) & W25Q_SR1_BUSY)
+    {
+        if(flash->micros() - start >= us)
+            return false;
+    }
+
+    return true;
+}
+
+/*  Waits for the chip to finish something that's overrun its time, as
+    it can't go back to XIP while it's busy. If it's still busy after the
+    longest anything takes, it's reset, which abandons whatever it was
+    doing, a suspended erase and all; erasing is left set, so the next
+    W25QErase() call starts that erase over.
+    Returns false if it had to be reset. */
+static bool __not_in_flash_func(W25QSettle)(w25q_t *flash)
+{
+    uint32_t start;
+
+    if(W25QWaitReady(flash, W25Q_T_SE))
+        return true;
+
+    TRACE_MARK("W25Q reset", 0);
+    W25QCommand(flash, W25Q_ENABLE_RESET);
+    W25QCommand(flash, W25Q_RESET);
+
+    // It doesn't answer until the reset's done, so just wait it out.
+    start = flash->micros();
+    while(flash->micros() - start < W25Q_T_RST)
+        W25QStatus(flash, W25Q_READ_SR1);
+
+    return false;
+}
+
+/*  Erases the sector at offset, for up to us microseconds.
+    Starts the erase if nothing is being erased, or resumes it if it was
+    suspended. If it hasn't finished in time it is suspended again, and
+    the rest of the chip can be used until the next call.
+    It only returns once the chip is ready, so XIP can be used again.
+    Returns:
+    W25Q_OK once the sector is erased.
+    W25Q_PENDING if the erase has been suspended part way through.
+    W25Q_ERROR_BUSY if a different sector is part way through erasing.
+    W25Q_ERROR_TIMEOUT if the chip didn't suspend, and had to be reset. */
+int8_t __not_in_flash_func(W25QErase)(w25q_t *flash, uint32_t offset, uint32_t us)
+{
+    uint32_t start;
+
+    offset &= ~(W25Q_SECTOR_SIZE - 1);
+
+    if(flash->erasing == W25Q_IDLE)
+    {
+        // An erase suspended before a reset is still suspended, and the
+        // chip ignores new erases until it is finished.
+        if(W25QStatus(flash, W25Q_READ_SR2) & W25Q_SR2_SUS)
+        {
+            W25QCommand(flash, W25Q_RESUME);
+            W25QWaitReady(flash, 400000);
+        }
+
+        TRACE_MARK("W25Q erase", offset / W25Q_SECTOR_SIZE);
+        W25QCommand(flash, W25Q_WRITE_ENABLE);
+        W25QAddrCommand(flash, W25Q_SECTOR_ERASE, offset, 0);
+        flash->erasing = offset;
+    }
+    else if(flash->erasing != offset)
+    {
+        return W25Q_ERROR_BUSY;
+    }
+    else if(!(W25QStatus(flash, W25Q_READ_SR2) & W25Q_SR2_SUS))
+    {
+        // A reset abandoned the erase while it was suspended.
+        TRACE_MARK("W25Q erase", offset / W25Q_SECTOR_SIZE);
+        W25QCommand(flash, W25Q_WRITE_ENABLE);
+        W25QAddrCommand(flash, W25Q_SECTOR_ERASE, offset, 0);
+    }
+    else
+    {
+        TRACE_MARK("W25Q resume", offset / W25Q_SECTOR_SIZE);
+        W25QCommand(flash, W25Q_RESUME);
+    }
+
+    // Suspending straight after resuming stops the erase from getting anywhere.
+    us = MAX(us, W25Q_MIN_SLICE);
+    start = flash->micros();
+
+    while(W25QStatus(flash, W25Q_READ_SR1) & W25Q_SR1_BUSY)
+    {
+        if(flash->micros() - start >= us)
+        {
+            TRACE_MARK("W25Q suspend", offset / W25Q_SECTOR_SIZE);
+            W25QCommand(flash, W25Q_SUSPEND);
+            // Should be ready within W25Q_T_SUS, but if the suspend
+            // doesn't take, the erase has to finish or be reset first.
+            if(!W25QSettle(flash))
+                return W25Q_ERROR_TIMEOUT;
+
+            // It may have finished just before the suspend went in.
+            if(W25QStatus(flash, W25Q_READ_SR2) & W25Q_SR2_SUS)
+                return W25Q_PENDING;
+
+            break;
+        }
+    }
+
+    flash->erasing = W25Q_IDLE;
+    return W25Q_OK;
+}
+
+/*  Programs the page at offset, and waits for it to finish. Works while an
+    erase is suspended, so long as it's not in the sector being erased.
+    Returns:
+    W25Q_OK if successful.
+    W25Q_ERROR_BUSY if the page is in the sector being erased.
+    W25Q_ERROR_TIMEOUT if the program didn't finish in time. The chip is
+    still waited on, or reset if it never finishes, so XIP can be used
+    again once this returns. */
+int8_t __not_in_flash_func(W25QProgram)(w25q_t *flash, uint32_t offset, const uint8_t *data)
+{
+    size_t i;
+
+    if(flash->erasing == (offset & ~(W25Q_SECTOR_SIZE - 1)))
+        return W25Q_ERROR_BUSY;
+
+    // memcpy lives in flash
+    for(i = 0; i < W25Q_PAGE_SIZE; i++)
+        txBuf[4 + i] = data[i];
+
+    W25QCommand(flash, W25Q_WRITE_ENABLE);
+    W25QAddrCommand(flash, W25Q_PAGE_PROGRAM, offset & ~(W25Q_PAGE_SIZE - 1), W25Q_PAGE_SIZE);
+
+    if(W25QWaitReady(flash, W25Q_T_PP))
+        return W25Q_OK;
+
+    W25QSettle(flash);
+    return W25Q_ERROR_TIMEOUT;
+}
@@ -0,0 +1,101 @@
+/*  Driver for the Winbond W25Q64 flash chip, that can suspend a sector erase
+    part way through.
+
+    A sector erase takes ~45 ms (up to 400 ms), and nothing can be read from
+    or programmed to the chip while it runs. Rather than wait, W25QErase runs
+    the erase for a while then suspends it. While it is suspended, the rest
+    of the chip can be read and programmed as normal, and the next call to
+    W25QErase resumes it.
+
+    The driver doesn't talk to the chip itself. Commands go through the cmd
+    function given to W25QInit, which clocks tx out and rx in with chip select
+    held low for the whole transfer. On the RP2040 that's flash_do_cmd;
+    sim/w25q64_model.h has a model of the chip to run against on a PC.
+
+    Everything here runs from RAM. XIP doesn't work while the chip is busy,
+    so interrupts should be disabled around each call when running on the
+    chip that holds the program. */
+
+#ifndef W25Q64_H
+#define W25Q64_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pico/stdlib.h"
+
+#define W25Q_PAGE_SIZE		256
+#define W25Q_SECTOR_SIZE	4096
+#define W25Q_IDLE		0xFFFFFFFF // erasing, when nothing is
+
+// W25Q64 commands
+#define W25Q_WRITE_ENABLE	0x06
+#define W25Q_READ_SR1		0x05
+#define W25Q_READ_SR2		0x35
+#define W25Q_READ_DATA		0x03
+#define W25Q_PAGE_PROGRAM	0x02
+#define W25Q_SECTOR_ERASE	0x20
+#define W25Q_SUSPEND		0x75
+#define W25Q_RESUME		0x7A
+#define W25Q_ENABLE_RESET	0x66
+#define W25Q_RESET		0x99
+
+// Status register bits
+#define W25Q_SR1_BUSY		(1 << 0)
+#define W25Q_SR1_WEL		(1 << 1)
+#define W25Q_SR2_SUS		(1 << 7)
+
+// Timings in us
+#define W25Q_T_SUS		20	// Suspend to ready
+#define W25Q_T_PP		3000	// Longest a page program takes
+#define W25Q_T_SE		400000	// Longest a sector erase takes
+#define W25Q_T_RST		30	// Reset to ready
+#define W25Q_MIN_SLICE		100	// Shortest an erase should run before suspending again
+
+// W25Q error codes
+#define W25Q_PENDING         1	// Erase suspended part way through
+#define W25Q_OK              0
+#define W25Q_ERROR_TIMEOUT  -1
+#define W25Q_ERROR_GENERIC  -2
+#define W25Q_ERROR_BUSY     -3	// Another sector is being erased
+
+typedef struct
+{
+    void (*cmd)(const uint8_t *tx, uint8_t *rx, size_t count);
+    uint32_t (*micros)(void);	// Free running us counter
+
+    uint32_t erasing;		// Sector being erased, or W25Q_IDLE
+} w25q_t;
+
+/*  Creates a W25Q struct that sends commands with cmd and tells time with
+    micros. */
+w25q_t W25QInit(void (*cmd)(const uint8_t *tx, uint8_t *rx, size_t count),
+                uint32_t (*micros)(void));
+
+/*  Reads a status register, W25Q_READ_SR1 or W25Q_READ_SR2 */
+uint8_t W25QStatus(w25q_t *flash, uint8_t reg);
+
+/*  Erases the sector at offset, for up to us microseconds.
+    Starts the erase if nothing is being erased, or resumes it if it was
+    suspended. If it hasn't finished in time it is suspended again, and
+    the rest of the chip can be used until the next call.
+    It only returns once the chip is ready, so XIP can be used again.
+    Returns:
+    W25Q_OK once the sector is erased.
+    W25Q_PENDING if the erase has been suspended part way through.
+    W25Q_ERROR_BUSY if a different sector is part way through erasing.
+    W25Q_ERROR_TIMEOUT if the chip didn't suspend, and had to be reset. */
+int8_t W25QErase(w25q_t *flash, uint32_t offset, uint32_t us);
+
+/*  Programs the page at offset, and waits for it to finish. Works while an
+    erase is suspended, so long as it's not in the sector being erased.
+    Returns:
+    W25Q_OK if successful.
+    W25Q_ERROR_BUSY if the page is in the sector being erased.
+    W25Q_ERROR_TIMEOUT if the program didn't finish in time. The chip is
+    still waited on, or reset if it never finishes, so XIP can be used
+    again once this returns. */
+int8_t W25QProgram(w25q_t *flash, uint32_t offset, const uint8_t *data);
+
+#endif
@@ -0,0 +1,131 @@
+#include "flight_model.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define G          9.80665f
+#define STEP_US    1000
+#define MAX_STEPS  (3600 * 1000) // Give up on landing after an hour
+#define ROLL_DPS   2.0f          // Roll rate per m/s of speed
+#define ROLL_MAX   200.0f        // Fastest roll, in dps
+#define MAG_H      0.2f          // Earth's field, horizontal and vertical, in gauss
+#define MAG_Z      -0.45f
+
+struct step
+{
+    float alt;
+    float vel;
+    float accel;    // Sensed, m/s^2
+    float roll;     // Degrees
+};
+
+static struct step *steps;
+static uint32_t stepCount;
+static uint64_t launchTime = UINT64_MAX;
+static uint32_t seed = 1;
+
+/* Flies the whole flight, a ms at a time */
+static void FlightModelFly(void)
+{
+    struct step s = {0};
+    bool chute = false;
+    float k;
+    float a;
+    float t;
+
+    steps = malloc(MAX_STEPS * sizeof(*steps));
+
+    for(stepCount = 0; stepCount < MAX_STEPS; stepCount++)
+    {
+        t = stepCount * (STEP_US / 1e6f);
+
+        // Out comes the parachute at apogee, which soon slows it to the
+        // descent rate.
+        if(!chute && t > FLIGHT_BURN_S && s.vel < 0)
+            chute = true;
+        k = chute ? G / (FLIGHT_DESCENT_MS * FLIGHT_DESCENT_MS) : FLIGHT_DRAG;
+
+        a = -G - k * s.vel * fabsf(s.vel);
+        if(t < FLIGHT_BURN_S)
+            a += FLIGHT_THRUST_G * G;
+
+        s.accel = a + G;
+        steps[stepCount] = s;
+
+        if(chute && s.alt <= 0)
+            break;
+
+        s.vel += a * (STEP_US / 1e6f);
+        s.alt += s.vel * (STEP_US / 1e6f);
+        s.roll = fmodf(s.roll + fminf(ROLL_DPS * fabsf(s.vel), ROLL_MAX) * (STEP_US / 1e6f), 360);
+    }
+}
+
+/*  Launches at t, in us since boot. Before it's called, it never does. */
+void FlightModelLaunch(uint64_t t)
+{
+    launchTime = t;
+}
+
+/*  Fills in the state at t, in us since boot */
+void FlightModelAt(uint64_t t, struct flight_state *s)
+{
+    struct step step = {0};
+    uint64_t n;
+    float roll;
+
+    step.accel = G;
+
+    if(steps == NULL)
+        FlightModelFly();
+
+    if(t >= launchTime)
+    {
+        n = (t - launchTime) / STEP_US;
+        if(n < stepCount)
+        {
+            step = steps[n];
+        }
+        else
+        {
+            // Landed, wherever it was when it stopped rolling.
+            step.roll = steps[stepCount - 1].roll;
+        }
+    }
+
+    roll = step.roll * (float) M_PI / 180;
+
+    s->alt = step.alt;
+    s->vel = step.vel;
+    s->accel[0] = 0;
+    s->accel[1] = 0;
+    s->accel[2] = step.accel / G;
+    s->gyro[0] = 0;
+    s->gyro[1] = 0;
+    s->gyro[2] = fminf(ROLL_DPS * fabsf(step.vel), ROLL_MAX);
+    s->mag[0] = MAG_H * cosf(roll);
+    s->mag[1] = -MAG_H * sinf(roll);
+    s->mag[2] = MAG_Z;
+
+    // The standard atmosphere
+    s->pres = FLIGHT_PAD_PA * powf(1 - 2.25577e-5f * step.alt, 5.25588f);
+    s->temp = FLIGHT_PAD_C - 0.0065f * step.alt;
+}
+
+/*  Returns roughly normally distributed noise, with a standard deviation of
+    1. The sequence is the same every run. */
+float FlightModelNoise(void)
+{
+    float sum = 0;
+    uint8_t i;
+
+    // The sum of 12 uniform numbers in [0, 1) has a variance of 1.
+    for(i = 0; i < 12; i++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        sum += (seed >> 8) / 16777216.0f;
+    }
+
+    return sum - 6;
+}
@@ -0,0 +1,45 @@
+/*  Model of a flight, for the sensor models to read.
+
+    Until launch, the board sits still on the pad, pointing up. From launch
+    the motor burns for FLIGHT_BURN_S, then the rocket coasts to apogee,
+    comes down under a parachute at about FLIGHT_DESCENT_MS and lands. Only
+    the vertical is modelled, with the board's Z axis pointing up the
+    rocket, and it rolls in proportion to its speed.
+
+    Everything comes from a table worked out in 1 ms steps the first time
+    it's needed, so the same time always gives the same state. */
+
+#ifndef FLIGHT_MODEL_H
+#define FLIGHT_MODEL_H
+
+#include <stdint.h>
+
+#define FLIGHT_BURN_S      2.5f   // Motor burn time
+#define FLIGHT_THRUST_G    9.0f   // Acceleration the motor gives, in g
+#define FLIGHT_DRAG        1e-4f  // Drag per m of the rocket, a = k v^2
+#define FLIGHT_DESCENT_MS  15.0f  // Descent rate under the parachute
+#define FLIGHT_PAD_PA      101325 // Pressure on the pad
+#define FLIGHT_PAD_C       20.0f  // Temperature on the pad
+
+struct flight_state
+{
+    float alt;       // m above the pad
+    float vel;       // m/s, up
+    float accel[3];  // What an accelerometer would read, in g
+    float gyro[3];   // dps
+    float mag[3];    // Gauss
+    float pres;      // Pa
+    float temp;      // Degrees
+};
+
+/*  Launches at t, in us since boot. Before it's called, it never does. */
+void FlightModelLaunch(uint64_t t);
+
+/*  Fills in the state at t, in us since boot */
+void FlightModelAt(uint64_t t, struct flight_state *s);
+
+/*  Returns roughly normally distributed noise, with a standard deviation of
+    1. The sequence is the same every run. */
+float FlightModelNoise(void);
+
+#endif
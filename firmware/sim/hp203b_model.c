@@ -0,0 +1,80 @@
+#include "hp203b_model.h"
+#include "flight_model.h"
+#include "hp203b.h"
+
+#include <string.h>
+
+// Pressure noise at each OSR, in Pa
+static const float noise[6] = {1.0f, 1.5f, 2.0f, 3.0f, 4.0f, 6.0f};
+
+static uint8_t command;     // Last command, which says what a read gets
+static uint64_t convEnd;    // When the running conversion is done
+static enum HP203_OSR osr;
+static bool converting;
+static uint8_t data[HP203_DATA_LEN];
+
+/* Picks up the result of a conversion that's finished by now */
+static void HP203ModelUpdate(uint64_t now)
+{
+    struct flight_state s;
+    uint32_t pres;
+    int32_t temp;
+
+    if(!converting || now < convEnd)
+        return;
+
+    FlightModelAt(convEnd, &s);
+    pres = s.pres + noise[osr] * FlightModelNoise();
+    temp = s.temp * 100 + 2 * FlightModelNoise();
+
+    // Both are 20 bits, MSB first, temperature first.
+    temp &= 0xFFFFF;
+    data[0] = temp >> 16;
+    data[1] = temp >> 8;
+    data[2] = temp;
+    data[3] = pres >> 16;
+    data[4] = pres >> 8;
+    data[5] = pres;
+
+    converting = false;
+}
+
+/*  A write of len bytes from buf, at now in us */
+void HP203ModelWrite(uint64_t now, const uint8_t *buf, size_t len)
+{
+    HP203ModelUpdate(now);
+    if(len == 0)
+        return;
+
+    command = buf[0];
+
+    if((command & 0xE0) == HP203_ADC_SET)
+    {
+        osr = MIN((command >> HP203_OSR_SHIFT) & 0x07, HP203_OSR_128);
+        convEnd = now + HP203MeasureTime(command & 0x03, osr);
+        converting = true;
+    }
+    else if(command == HP203_RESET)
+    {
+        converting = false;
+        memset(data, 0, sizeof(data));
+    }
+}
+
+/*  A read of len bytes into buf, at now in us */
+void HP203ModelRead(uint64_t now, uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    HP203ModelUpdate(now);
+
+    for(i = 0; i < len; i++)
+    {
+        if(command == HP203_READ_PT)
+            buf[i] = i < HP203_DATA_LEN ? data[i] : 0;
+        else if(command == (HP203_READ_REG | HP203_INT_SRC))
+            buf[i] = 0x40;  // Device ready
+        else
+            buf[i] = 0;
+    }
+}
@@ -0,0 +1,20 @@
+/*  Model of the HP203B barometer, for running the firmware on a PC.
+
+    Takes the same commands as the chip, and reads pressure and temperature
+    off flight_model.h. A conversion takes as long as the datasheet says for
+    its OSR; reading before it's done gets the last one's result. Noise
+    goes down as the OSR goes up. */
+
+#ifndef HP203B_MODEL_H
+#define HP203B_MODEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  A write of len bytes from buf, at now in us */
+void HP203ModelWrite(uint64_t now, const uint8_t *buf, size_t len);
+
+/*  A read of len bytes into buf, at now in us */
+void HP203ModelRead(uint64_t now, uint8_t *buf, size_t len);
+
+#endif
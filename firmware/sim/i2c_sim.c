@@ -0,0 +1,293 @@
+#include "sim.h"
+#include "hp203b_model.h"
+#include "qmc5883l_model.h"
+#include "qmi8658c_model.h"
+
+#include "pico/stdlib.h"
+#include "hardware/i2c.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+
+#define SIM_I2C_BITS   9   // Bits on the bus a byte, with its ACK
+#define SIM_I2C_TX_MAX 16  // Most bytes written before a read
+
+struct sim_i2c_device
+{
+    uint8_t addr;
+    void (*write)(uint64_t now, const uint8_t *buf, size_t len);
+    void (*read)(uint64_t now, uint8_t *buf, size_t len);
+};
+
+static const struct sim_i2c_device devices[] =
+{
+    {0x76, HP203ModelWrite, HP203ModelRead},
+    {0x0D, QMCModelWrite, QMCModelRead},
+    {0x6B, QMIModelWrite, QMIModelRead}  // SA0 is pulled high on Bob
+};
+
+struct sim_dma_channel
+{
+    bool claimed;
+    volatile void *write;
+    const volatile void *read;
+    uint32_t count;
+};
+
+static i2c_hw_t i2c0Hw;
+i2c_inst_t i2c0_inst = {&i2c0Hw, 100000};
+
+static struct sim_dma_channel channels[NUM_DMA_CHANNELS];
+
+// The transfer the DMA is running, fed to data_cmd from cmds
+static const struct sim_i2c_device *xferDevice;
+static const uint32_t *xferCmds;
+static uint32_t xferCount;
+static uint8_t *xferRx;
+
+static uint64_t i2cBytes;
+static uint64_t i2cBusy;
+
+static const struct sim_i2c_device *SimI2CFind(uint8_t addr)
+{
+    size_t i;
+
+    for(i = 0; i < count_of(devices); i++)
+    {
+        if(devices[i].addr == addr)
+            return &devices[i];
+    }
+
+    return NULL;
+}
+
+/* How long bytes take on the bus, in us */
+static uint64_t SimI2CTime(i2c_inst_t *i2c, size_t bytes)
+{
+    uint64_t us = (bytes * SIM_I2C_BITS * 1000000ull + i2c->baudrate - 1) / i2c->baudrate;
+
+    i2cBytes += bytes;
+    i2cBusy += us;
+    return us;
+}
+
+uint i2c_init(i2c_inst_t *i2c, uint baudrate)
+{
+    i2c->baudrate = baudrate;
+    return baudrate;
+}
+
+int i2c_write_blocking(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop)
+{
+    const struct sim_i2c_device *dev = SimI2CFind(addr);
+
+    (void) nostop;
+    if(dev == NULL)
+    {
+        SimSpend(SimI2CTime(i2c, 1));
+        return PICO_ERROR_GENERIC;
+    }
+
+    dev->write(SimMicros(), src, len);
+    SimSpend(SimI2CTime(i2c, len + 1));
+    return len;
+}
+
+int i2c_read_blocking(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop)
+{
+    const struct sim_i2c_device *dev = SimI2CFind(addr);
+
+    (void) nostop;
+    if(dev == NULL)
+    {
+        SimSpend(SimI2CTime(i2c, 1));
+        return PICO_ERROR_GENERIC;
+    }
+
+    dev->read(SimMicros(), dst, len);
+    SimSpend(SimI2CTime(i2c, len + 1));
+    return len;
+}
+
+int i2c_write_timeout_per_char_us(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len,
+                                  bool nostop, uint timeout_per_char_us)
+{
+    (void) timeout_per_char_us;
+    return i2c_write_blocking(i2c, addr, src, len, nostop);
+}
+
+int i2c_read_timeout_per_char_us(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len,
+                                 bool nostop, uint timeout_per_char_us)
+{
+    (void) timeout_per_char_us;
+    return i2c_read_blocking(i2c, addr, dst, len, nostop);
+}
+
+/* Runs the commands the DMA fed to data_cmd against the device, once the bus
+   would've finished with them, and raises the IRQ. Writes go in one piece
+   up to the first read, and each run of reads after a restart in another. */
+static void SimI2CDone(void)
+{
+    uint8_t buf[SIM_I2C_TX_MAX];
+    size_t txLen = 0;
+    size_t rxLen;
+    uint32_t i = 0;
+
+    if(xferDevice == NULL)
+    {
+        i2c0Hw.intr_stat = I2C_IC_INTR_STAT_R_TX_ABRT_BITS | I2C_IC_INTR_STAT_R_STOP_DET_BITS;
+        i2c0Hw.raw_intr_stat = i2c0Hw.intr_stat;
+        SimRaiseIrq(I2C0_IRQ);
+        return;
+    }
+
+    while(i < xferCount)
+    {
+        if(!(xferCmds[i] & I2C_IC_DATA_CMD_CMD_BITS))
+        {
+            if(txLen < sizeof(buf))
+                buf[txLen++] = xferCmds[i];
+            i++;
+            continue;
+        }
+
+        if(txLen > 0)
+            xferDevice->write(SimMicros(), buf, txLen);
+        txLen = 0;
+
+        for(rxLen = 1; i + rxLen < xferCount; rxLen++)
+        {
+            if(!(xferCmds[i + rxLen] & I2C_IC_DATA_CMD_CMD_BITS)
+               || xferCmds[i + rxLen] & I2C_IC_DATA_CMD_RESTART_BITS)
+                break;
+        }
+
+        if(xferRx != NULL)
+        {
+            xferDevice->read(SimMicros(), xferRx, rxLen);
+            xferRx += rxLen;
+        }
+        i += rxLen;
+    }
+
+    if(txLen > 0)
+        xferDevice->write(SimMicros(), buf, txLen);
+
+    i2c0Hw.intr_stat = I2C_IC_INTR_STAT_R_STOP_DET_BITS;
+    i2c0Hw.raw_intr_stat = i2c0Hw.intr_stat;
+    SimRaiseIrq(I2C0_IRQ);
+}
+
+/* Starts the transfer in the commands the DMA channel feeds to data_cmd. The
+   bytes read go wherever the channel reading data_cmd points. */
+static void SimI2CStart(struct sim_dma_channel *tx)
+{
+    uint32_t starts = 1;
+    uint32_t i;
+
+    xferDevice = SimI2CFind(i2c0Hw.tar);
+    xferCmds = (const uint32_t *) tx->read;
+    xferCount = tx->count;
+    xferRx = NULL;
+    i2c0Hw.intr_stat = 0;
+    i2c0Hw.raw_intr_stat = 0;
+
+    for(i = 0; i < NUM_DMA_CHANNELS; i++)
+    {
+        if(channels[i].claimed && channels[i].read == &i2c0Hw.data_cmd)
+            xferRx = (uint8_t *) channels[i].write;
+    }
+
+    for(i = 0; i < xferCount; i++)
+    {
+        if(xferCmds[i] & I2C_IC_DATA_CMD_RESTART_BITS)
+            starts++;
+    }
+
+    // Without a device, only the address goes out before it's NAKed.
+    SimSchedule(SimMicros() + SimI2CTime(&i2c0_inst, xferDevice ? xferCount + starts : 1),
+                SimI2CDone);
+}
+
+/*  Returns how many bytes have gone over the I2C bus, and for how long it
+    has been busy in us. */
+void SimI2CStats(uint64_t *bytes, uint64_t *busyUs)
+{
+    *bytes = i2cBytes;
+    *busyUs = i2cBusy;
+}
+
+static void SimDmaTrigger(uint channel)
+{
+    if(channels[channel].write == &i2c0Hw.data_cmd)
+        SimI2CStart(&channels[channel]);
+}
+
+int dma_claim_unused_channel(bool required)
+{
+    int i;
+
+    for(i = 0; i < NUM_DMA_CHANNELS; i++)
+    {
+        if(!channels[i].claimed)
+        {
+            channels[i].claimed = true;
+            return i;
+        }
+    }
+
+    if(required)
+        SimEnd();
+
+    return -1;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel)
+{
+    dma_channel_config c = {channel};
+    return c;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config,
+                           volatile void *write_addr, const volatile void *read_addr,
+                           uint transfer_count, bool trigger)
+{
+    (void) config;
+    channels[channel].write = write_addr;
+    channels[channel].read = read_addr;
+    channels[channel].count = transfer_count;
+    if(trigger)
+        SimDmaTrigger(channel);
+}
+
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger)
+{
+    channels[channel].read = read_addr;
+    if(trigger)
+        SimDmaTrigger(channel);
+}
+
+void dma_channel_set_write_addr(uint channel, volatile void *write_addr, bool trigger)
+{
+    channels[channel].write = write_addr;
+    if(trigger)
+        SimDmaTrigger(channel);
+}
+
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger)
+{
+    channels[channel].count = trans_count;
+    if(trigger)
+        SimDmaTrigger(channel);
+}
+
+void dma_channel_abort(uint channel)
+{
+    (void) channel;
+}
+
+/* Transfers are done by the time their IRQ is raised. */
+bool dma_channel_is_busy(uint channel)
+{
+    (void) channel;
+    return false;
+}
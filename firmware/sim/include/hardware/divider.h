@@ -0,0 +1,10 @@
+/*  Stand-in for the Pico SDK's hardware/divider.h, for the native build. */
+
+#ifndef SIM_HARDWARE_DIVIDER_H
+#define SIM_HARDWARE_DIVIDER_H
+
+#include "pico/stdlib.h"
+
+static inline uint32_t hw_divider_u32_quotient_inlined(uint32_t a, uint32_t b) { return a / b; }
+
+#endif
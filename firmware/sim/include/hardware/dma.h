@@ -0,0 +1,62 @@
+/*  Stand-in for the Pico SDK's hardware/dma.h, for the native build.
+
+    Only moves data to and from the I2C block's data_cmd register, which is
+    all lib/i2cq uses it for. Triggering the channel that writes data_cmd
+    starts the I2C transfer; the channel that reads it is where the bytes
+    read end up. */
+
+#ifndef SIM_HARDWARE_DMA_H
+#define SIM_HARDWARE_DMA_H
+
+#include "pico/stdlib.h"
+
+#define NUM_DMA_CHANNELS 12
+#define DREQ_I2C0_TX 32
+#define DREQ_I2C0_RX 33
+
+enum dma_channel_transfer_size
+{
+    DMA_SIZE_8 = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2
+};
+
+typedef struct
+{
+    uint32_t ctrl;
+} dma_channel_config;
+
+int dma_claim_unused_channel(bool required);
+dma_channel_config dma_channel_get_default_config(uint channel);
+
+static inline void channel_config_set_transfer_data_size(dma_channel_config *c,
+                                                         enum dma_channel_transfer_size size)
+{
+    (void) c; (void) size;
+}
+
+static inline void channel_config_set_read_increment(dma_channel_config *c, bool incr)
+{
+    (void) c; (void) incr;
+}
+
+static inline void channel_config_set_write_increment(dma_channel_config *c, bool incr)
+{
+    (void) c; (void) incr;
+}
+
+static inline void channel_config_set_dreq(dma_channel_config *c, uint dreq)
+{
+    (void) c; (void) dreq;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config,
+                           volatile void *write_addr, const volatile void *read_addr,
+                           uint transfer_count, bool trigger);
+void dma_channel_set_read_addr(uint channel, const volatile void *read_addr, bool trigger);
+void dma_channel_set_write_addr(uint channel, volatile void *write_addr, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+void dma_channel_abort(uint channel);
+bool dma_channel_is_busy(uint channel);
+
+#endif
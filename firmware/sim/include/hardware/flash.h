@@ -0,0 +1,15 @@
+/*  Stand-in for the Pico SDK's hardware/flash.h, for the native build.
+    Commands go to sim/w25q64_model.h, and take a microsecond each. */
+
+#ifndef SIM_HARDWARE_FLASH_H
+#define SIM_HARDWARE_FLASH_H
+
+#include "pico/stdlib.h"
+
+#define FLASH_PAGE_SIZE   (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define FLASH_BLOCK_SIZE  (1u << 16)
+
+void flash_do_cmd(const uint8_t *txbuf, uint8_t *rxbuf, size_t count);
+
+#endif
@@ -0,0 +1,67 @@
+/*  Stand-in for the Pico SDK's hardware/i2c.h, for the native build.
+
+    The blocking functions talk straight to the sensor models in sim/, and
+    take as long as the bytes would on the bus. The registers are only the
+    ones lib/i2cq uses: a command sequence fed to data_cmd by the DMA (see
+    hardware/dma.h) runs against the models in the background, then sets
+    STOP_DET, or TX_ABRT if nothing answered, in intr_stat and raw_intr_stat.
+    The bus is never left active, so status is always 0. */
+
+#ifndef SIM_HARDWARE_I2C_H
+#define SIM_HARDWARE_I2C_H
+
+#include "pico/stdlib.h"
+
+typedef struct
+{
+    volatile uint32_t con;
+    volatile uint32_t tar;
+    volatile uint32_t data_cmd;
+    volatile uint32_t intr_stat;
+    volatile uint32_t intr_mask;
+    volatile uint32_t raw_intr_stat;
+    volatile uint32_t clr_intr;
+    volatile uint32_t clr_tx_abrt;
+    volatile uint32_t clr_stop_det;
+    volatile uint32_t enable;
+    volatile uint32_t status;
+    volatile uint32_t dma_cr;
+    volatile uint32_t dma_tdlr;
+    volatile uint32_t dma_rdlr;
+} i2c_hw_t;
+
+typedef struct i2c_inst
+{
+    i2c_hw_t *hw;
+    uint baudrate;
+} i2c_inst_t;
+
+extern i2c_inst_t i2c0_inst;
+#define i2c0 (&i2c0_inst)
+#define i2c_default i2c0
+
+#define I2C_IC_DATA_CMD_CMD_BITS            0x00000100
+#define I2C_IC_DATA_CMD_STOP_BITS           0x00000200
+#define I2C_IC_DATA_CMD_RESTART_BITS        0x00000400
+#define I2C_IC_INTR_STAT_R_TX_ABRT_BITS     0x00000040
+#define I2C_IC_INTR_STAT_R_STOP_DET_BITS    0x00000200
+#define I2C_IC_INTR_MASK_M_TX_ABRT_BITS     0x00000040
+#define I2C_IC_INTR_MASK_M_STOP_DET_BITS    0x00000200
+#define I2C_IC_RAW_INTR_STAT_STOP_DET_BITS  0x00000200
+#define I2C_IC_STATUS_MST_ACTIVITY_BITS     0x00000020
+#define I2C_IC_DMA_CR_RDMAE_BITS            0x00000001
+#define I2C_IC_DMA_CR_TDMAE_BITS            0x00000002
+
+uint i2c_init(i2c_inst_t *i2c, uint baudrate);
+
+static inline i2c_hw_t *i2c_get_hw(i2c_inst_t *i2c) { return i2c->hw; }
+static inline uint i2c_hw_index(i2c_inst_t *i2c) { (void) i2c; return 0; }
+
+int i2c_write_blocking(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop);
+int i2c_read_blocking(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop);
+int i2c_write_timeout_per_char_us(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len,
+                                  bool nostop, uint timeout_per_char_us);
+int i2c_read_timeout_per_char_us(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len,
+                                 bool nostop, uint timeout_per_char_us);
+
+#endif
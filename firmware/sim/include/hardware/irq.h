@@ -0,0 +1,17 @@
+/*  Stand-in for the Pico SDK's hardware/irq.h, for the native build.
+    Handlers run on the core that enabled the IRQ, while it's waiting. */
+
+#ifndef SIM_HARDWARE_IRQ_H
+#define SIM_HARDWARE_IRQ_H
+
+#include "pico/stdlib.h"
+
+#define I2C0_IRQ 23
+#define NUM_IRQS 32
+
+typedef void (*irq_handler_t)(void);
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_set_enabled(uint num, bool enabled);
+
+#endif
@@ -0,0 +1,9 @@
+/*  Stand-in for the Pico SDK's hardware/sync.h, for the native build.
+    __wfe, __sev and friends are in pico/stdlib.h. */
+
+#ifndef SIM_HARDWARE_SYNC_H
+#define SIM_HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+#endif
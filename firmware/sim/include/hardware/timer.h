@@ -0,0 +1,31 @@
+/*  Stand-in for the Pico SDK's hardware/timer.h, for the native build.
+
+    The registers are kept up to date with the simulator's time. Writing an
+    alarm register arms it, as on the chip: it goes off when the low 32 bits
+    of the time match, raising TIMER_IRQ_0 + n if its bit is set in inte. */
+
+#ifndef SIM_HARDWARE_TIMER_H
+#define SIM_HARDWARE_TIMER_H
+
+#include "pico/stdlib.h"
+
+#define NUM_TIMERS 4
+#define TIMER_IRQ_0 0
+
+typedef struct
+{
+    volatile uint32_t alarm[NUM_TIMERS];
+    volatile uint32_t timerawh;
+    volatile uint32_t timerawl;
+    volatile uint32_t intr;
+    volatile uint32_t inte;
+} timer_hw_t;
+
+extern timer_hw_t sim_timer_hw;
+#define timer_hw (&sim_timer_hw)
+
+uint hardware_alarm_claim_unused(bool required);
+
+static inline void hw_set_bits(volatile uint32_t *addr, uint32_t mask) { *addr |= mask; }
+
+#endif
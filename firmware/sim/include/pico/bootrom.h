@@ -0,0 +1,11 @@
+/*  Stand-in for the Pico SDK's pico/bootrom.h, for the native build.
+    Rebooting into BOOTSEL ends the run. */
+
+#ifndef SIM_PICO_BOOTROM_H
+#define SIM_PICO_BOOTROM_H
+
+#include "pico/stdlib.h"
+
+void reset_usb_boot(uint32_t gpio_mask, uint32_t disable_interface_mask);
+
+#endif
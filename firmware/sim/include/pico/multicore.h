@@ -0,0 +1,13 @@
+/*  Stand-in for the Pico SDK's pico/multicore.h, for the native build.
+    Each core is a thread, but only one runs at a time; see sim/sim.h. */
+
+#ifndef SIM_PICO_MULTICORE_H
+#define SIM_PICO_MULTICORE_H
+
+#include "pico/stdlib.h"
+
+void multicore_launch_core1(void (*entry)(void));
+void multicore_fifo_push_blocking(uint32_t data);
+uint32_t multicore_fifo_pop_blocking(void);
+
+#endif
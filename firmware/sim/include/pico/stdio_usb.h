@@ -0,0 +1,16 @@
+/*  Stand-in for the Pico SDK's pico/stdio_usb.h, for the native build.
+    The simulator's script says when USB is plugged in. */
+
+#ifndef SIM_PICO_STDIO_USB_H
+#define SIM_PICO_STDIO_USB_H
+
+#include "pico/stdlib.h"
+
+typedef struct
+{
+    void (*out_chars)(const char *buf, int len);
+} stdio_driver_t;
+
+extern stdio_driver_t stdio_usb;
+
+#endif
@@ -0,0 +1,87 @@
+/*  Stand-in for the Pico SDK's pico/stdlib.h, for the native build.
+
+    Only what the firmware uses is here. Time is the simulator's, not the
+    PC's: it only moves while both cores are waiting on something, or when a
+    core busy-waits, so a run takes as long as the work in it rather than
+    the time it covers. See sim/sim.h. */
+
+#ifndef SIM_PICO_STDLIB_H
+#define SIM_PICO_STDLIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "bob.h"
+#include "w25q64_model.h"
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;   // us since boot
+
+#define PICO_ERROR_TIMEOUT -1
+#define PICO_ERROR_GENERIC -2
+
+// Reads of the flash go straight to the model's memory.
+#define XIP_BASE ((uintptr_t) W25QModelMemory())
+
+#define MIN(a, b) ((b) > (a) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+// Everything runs from RAM on a PC.
+#define __not_in_flash(group)
+#define __not_in_flash_func(func) func
+#define __time_critical_func(func) func
+
+extern const absolute_time_t at_the_end_of_time;
+
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline bool is_at_the_end_of_time(absolute_time_t t) { return t == at_the_end_of_time; }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return t / 1000; }
+static inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to)
+{
+    return (int64_t)(to - from);
+}
+
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+absolute_time_t get_absolute_time(void);
+absolute_time_t make_timeout_time_us(uint64_t us);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+bool time_reached(absolute_time_t t);
+
+void sleep_until(absolute_time_t t);
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+void busy_wait_us(uint64_t us);
+
+/*  Sleeps until t, or until an event or interrupt comes in first.
+    Returns true if t was reached. */
+bool best_effort_wfe_or_timeout(absolute_time_t t);
+
+// Cores and events
+uint get_core_num(void);
+void __wfe(void);
+void __sev(void);
+void __dmb(void);
+void tight_loop_contents(void);   // Takes a microsecond, so spinning moves time on
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+
+// USB stdio. Output goes to stdout while plugged in.
+bool stdio_init_all(void);
+bool stdio_usb_connected(void);
+void stdio_flush(void);
+int getchar_timeout_us(uint32_t timeout);
+
+// GPIO does nothing.
+#define GPIO_FUNC_I2C 3
+static inline void gpio_set_function(uint gpio, uint fn) { (void) gpio; (void) fn; }
+static inline void gpio_pull_up(uint gpio) { (void) gpio; }
+
+#endif
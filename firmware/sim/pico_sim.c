@@ -0,0 +1,820 @@
+#define _GNU_SOURCE
+#include "sim.h"
+#include "w25q64_model.h"
+#include "flight_model.h"
+
+#include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
+#include "pico/multicore.h"
+#include "pico/bootrom.h"
+#include "hardware/flash.h"
+#include "hardware/timer.h"
+#include "hardware/irq.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_CORES       2
+#define SIM_EVENTS      16    // Most callbacks waiting at once
+#define SIM_FIFO_DEPTH  8     // Same as the chip's inter-core FIFOs
+#define SIM_INPUT_MAX   4096  // Most typed characters waiting to be read
+#define SIM_ACTIONS_MAX 1024  // Most lines in a script
+#define SIM_TAIL_US     1000000 // How long a run goes on after the last action
+
+#define GETCHAR_POLL_US 5     // What a look at the USB receive buffer costs
+#define USB_BYTE_US     1     // What sending a byte over USB costs
+#define FLASH_BITS_US   64    // SPI bits to the flash a us
+
+const absolute_time_t at_the_end_of_time = INT64_MAX;   // As in the SDK
+timer_hw_t sim_timer_hw;
+
+struct sim_core
+{
+    bool started;
+    bool waiting;       // Blocked in SimBlock
+    bool wakeable;      // An event ends the wait too
+    bool event;         // The event register, set by __sev and interrupts
+    bool irqsOff;
+    uint64_t until;     // When the wait ends by itself
+    uint64_t owed;      // Time spent that hasn't been waited out yet, in us
+    uint32_t fifo[SIM_FIFO_DEPTH]; // Words sent to this core
+    uint8_t fifoHead;
+    uint8_t fifoCount;
+};
+
+enum sim_action_type
+{
+    SIM_PLUG,
+    SIM_UNPLUG,
+    SIM_TYPE,
+    SIM_LAUNCH,
+    SIM_END
+};
+
+struct sim_action
+{
+    uint64_t when;
+    enum sim_action_type type;
+    char *text;
+};
+
+struct sim_event
+{
+    uint64_t when;
+    void (*fn)(void);
+};
+
+// Only the thread holding the baton runs, and it holds lock while it does.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t baton = PTHREAD_COND_INITIALIZER;
+static unsigned running;                // Core whose thread is running
+static __thread unsigned self;          // Core this thread is
+static unsigned simCore;                // Core the code running is on
+static bool inIrq;
+
+static struct sim_core cores[SIM_CORES];
+static uint64_t simNow;
+
+static irq_handler_t handlers[NUM_IRQS];
+static uint32_t irqEnabled;
+static uint32_t irqPending;
+static unsigned irqOwner[NUM_IRQS];
+
+static uint32_t alarmsClaimed;
+static uint32_t alarmsArmed;
+static uint32_t alarmShadow[NUM_TIMERS]; // Alarm registers as last seen
+static uint64_t alarmAt[NUM_TIMERS];
+
+static struct sim_event events[SIM_EVENTS];
+static uint8_t eventCount;
+
+static struct sim_action actions[SIM_ACTIONS_MAX];
+static size_t actionCount;
+static bool scripted;            // False if stdin had no actions in it
+static size_t nextAction;
+
+static char input[SIM_INPUT_MAX];
+static size_t inputHead;
+static size_t inputCount;
+
+static bool plugged = true;
+static FILE *usbOut;
+static uint64_t usbBytes;
+
+static struct timespec wallStart;
+static const char *flashPath;
+
+stdio_driver_t stdio_usb;
+
+/* Brings the timer registers up to date with the time */
+static void SimSetNow(uint64_t t)
+{
+    simNow = t;
+    sim_timer_hw.timerawh = t >> 32;
+    sim_timer_hw.timerawl = t;
+}
+
+/* Arms any alarm whose register has been written since we last looked.
+   Like the chip, one set to a time that's already gone doesn't go off. */
+static void SimCheckAlarms(void)
+{
+    uint32_t diff;
+    uint8_t i;
+
+    for(i = 0; i < NUM_TIMERS; i++)
+    {
+        if(sim_timer_hw.alarm[i] == alarmShadow[i])
+            continue;
+
+        alarmShadow[i] = sim_timer_hw.alarm[i];
+        diff = alarmShadow[i] - (uint32_t) simNow;
+        if(diff != 0 && diff < 0x80000000u)
+        {
+            alarmsArmed |= 1u << i;
+            alarmAt[i] = simNow + diff;
+        }
+    }
+}
+
+/* Runs the handlers of any IRQs that are waiting, on the core that enabled
+   them, if it can take them. */
+static void SimDeliverIrqs(void)
+{
+    unsigned prev = simCore;
+    unsigned owner;
+    unsigned num;
+
+    if(inIrq)
+        return;
+
+    for(num = 0; num < NUM_IRQS; num++)
+    {
+        if(!(irqPending & irqEnabled & 1u << num) || handlers[num] == NULL)
+            continue;
+
+        owner = irqOwner[num];
+        if(cores[owner].irqsOff)
+            continue;
+
+        irqPending &= ~(1u << num);
+        simCore = owner;
+        inIrq = true;
+        handlers[num]();
+        inIrq = false;
+        simCore = prev;
+
+        // Returning from an exception sets the event register.
+        cores[owner].event = true;
+    }
+}
+
+/*  Raises IRQ num. Its handler runs straight away if the core that enabled
+    it can take it, or as soon as it can otherwise. */
+void SimRaiseIrq(unsigned num)
+{
+    irqPending |= 1u << num;
+    SimDeliverIrqs();
+}
+
+/* Does everything that's due by now: alarms, callbacks and script actions */
+static void SimFireDue(void)
+{
+    struct sim_action *a;
+    void (*fn)(void);
+    size_t i;
+    uint8_t j;
+
+    for(j = 0; j < NUM_TIMERS; j++)
+    {
+        if(alarmsArmed & 1u << j && alarmAt[j] <= simNow)
+        {
+            alarmsArmed &= ~(1u << j);
+            sim_timer_hw.intr |= 1u << j;
+            if(sim_timer_hw.inte & 1u << j)
+                SimRaiseIrq(TIMER_IRQ_0 + j);
+            sim_timer_hw.intr &= ~(1u << j);
+        }
+    }
+
+    // Callbacks can schedule more, so take them one at a time, in order.
+    while(true)
+    {
+        j = SIM_EVENTS;
+        for(i = 0; i < eventCount; i++)
+        {
+            if(events[i].when <= simNow && (j == SIM_EVENTS || events[i].when < events[j].when))
+                j = i;
+        }
+
+        if(j == SIM_EVENTS)
+            break;
+
+        fn = events[j].fn;
+        events[j] = events[--eventCount];
+        fn();
+    }
+
+    while(nextAction < actionCount && actions[nextAction].when <= simNow)
+    {
+        a = &actions[nextAction++];
+        switch(a->type)
+        {
+        case SIM_PLUG:
+            plugged = true;
+            break;
+        case SIM_UNPLUG:
+            plugged = false;
+            inputCount = 0;
+            break;
+        case SIM_TYPE:
+            for(i = 0; a->text[i] && inputCount < SIM_INPUT_MAX; i++)
+                input[(inputHead + inputCount++) % SIM_INPUT_MAX] = a->text[i];
+            break;
+        case SIM_LAUNCH:
+            FlightModelLaunch(simNow);
+            break;
+        case SIM_END:
+            SimEnd();
+            break;
+        }
+    }
+
+    if(scripted && nextAction == actionCount &&
+       simNow >= actions[actionCount - 1].when + SIM_TAIL_US)
+        SimEnd();
+}
+
+/* The earliest time anything is due */
+static uint64_t SimNextDue(void)
+{
+    uint64_t next = SIM_FOREVER;
+    uint8_t i;
+
+    for(i = 0; i < SIM_CORES; i++)
+    {
+        if(cores[i].started && cores[i].waiting)
+            next = MIN(next, cores[i].until);
+    }
+
+    for(i = 0; i < NUM_TIMERS; i++)
+    {
+        if(alarmsArmed & 1u << i)
+            next = MIN(next, alarmAt[i]);
+    }
+
+    for(i = 0; i < eventCount; i++)
+        next = MIN(next, events[i].when);
+
+    if(nextAction < actionCount)
+        next = MIN(next, actions[nextAction].when);
+    else if(scripted)
+        next = MIN(next, actions[actionCount - 1].when + SIM_TAIL_US);
+
+    return next;
+}
+
+/* Returns true if core n can carry on, and takes the event that woke it */
+static bool SimReady(unsigned n)
+{
+    struct sim_core *c = &cores[n];
+
+    if(!c->started || !c->waiting)
+        return false;
+
+    if(c->wakeable && c->event)
+        c->event = false;
+    else if(simNow < c->until)
+        return false;
+
+    c->waiting = false;
+    return true;
+}
+
+/* Runs whatever's due, moving time on until a core can carry on, and hands
+   over to it. Returns once this thread's core is the one to carry on. */
+static void SimRun(void)
+{
+    unsigned n;
+    unsigned i;
+
+    while(true)
+    {
+        SimCheckAlarms();
+        SimFireDue();
+
+        // Start with the other core, so neither can starve the other.
+        for(i = 1; i <= SIM_CORES; i++)
+        {
+            n = (running + i) % SIM_CORES;
+            if(!SimReady(n))
+                continue;
+
+            if(n != self)
+            {
+                running = n;
+                pthread_cond_broadcast(&baton);
+                while(running != self)
+                    pthread_cond_wait(&baton, &lock);
+            }
+
+            simCore = self;
+            return;
+        }
+
+        if(SimNextDue() == SIM_FOREVER)
+        {
+            fprintf(stderr, "sim: both cores are waiting on nothing\n");
+            SimEnd();
+        }
+
+        SimSetNow(MAX(simNow, SimNextDue()));
+    }
+}
+
+/* Blocks the running core until until, or if wakeable, until an event comes
+   in first. Interrupts can run meanwhile. */
+static void SimBlock(uint64_t until, bool wakeable)
+{
+    struct sim_core *c = &cores[simCore];
+    uint64_t owed;
+
+    // Handlers spinning on something don't get anywhere, and don't need to.
+    if(inIrq)
+        return;
+
+    if(simCore == 0 && usbOut != NULL)
+        fflush(usbOut);
+
+    if(c->owed > 0)
+    {
+        owed = c->owed;
+        c->owed = 0;
+        SimBlock(simNow + owed, false);
+    }
+
+    if(wakeable && c->event)
+    {
+        c->event = false;
+        return;
+    }
+
+    c->waiting = true;
+    c->wakeable = wakeable;
+    c->until = until;
+    SimRun();
+}
+
+/*  Returns the time since boot, in us */
+uint64_t SimMicros(void)
+{
+    return simNow;
+}
+
+/*  Keeps the calling core busy for us, letting the other core and any
+    interrupts run meanwhile. */
+void SimSpend(uint64_t us)
+{
+    SimBlock(simNow + us, false);
+}
+
+/*  Calls fn at time when, from the scheduler, as if it were hardware.
+    Returns false if too many are already waiting. */
+bool SimSchedule(uint64_t when, void (*fn)(void))
+{
+    if(eventCount == SIM_EVENTS)
+        return false;
+
+    events[eventCount].when = when;
+    events[eventCount].fn = fn;
+    eventCount++;
+    return true;
+}
+
+/*  Stops the run, printing how it went to stderr. */
+void SimEnd(void)
+{
+    struct timespec wall;
+    double wallSec;
+    uint64_t i2cBytes;
+    uint64_t i2cBusy;
+    FILE *f;
+
+    if(usbOut != NULL)
+        fflush(usbOut);
+
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    wallSec = (wall.tv_sec - wallStart.tv_sec) + (wall.tv_nsec - wallStart.tv_nsec) / 1e9;
+    SimI2CStats(&i2cBytes, &i2cBusy);
+
+    fprintf(stderr,
+            "sim: %.3f s simulated in %.3f s (%.0fx)\n"
+            "sim: I2C %llu bytes, bus busy %.1f%%\n"
+            "sim: USB %llu bytes out\n"
+            "sim: flash violations %u\n",
+            simNow / 1e6, wallSec, simNow / 1e6 / MAX(wallSec, 1e-9),
+            (unsigned long long) i2cBytes, 100.0 * i2cBusy / MAX(simNow, 1),
+            (unsigned long long) usbBytes,
+            W25QModelViolations());
+
+    if(flashPath != NULL && (f = fopen(flashPath, "wb")) != NULL)
+    {
+        fwrite(W25QModelMemory(), 1, W25Q_MODEL_SIZE, f);
+        fclose(f);
+    }
+
+    // The other core is parked on the baton, and can stay there.
+    _exit(W25QModelViolations() ? 1 : 0);
+}
+
+/* Reads the script from stdin */
+static void SimLoadScript(void)
+{
+    char line[512];
+    char word[16];
+    double ms;
+    int used;
+    struct sim_action *a;
+    size_t len;
+
+    while(fgets(line, sizeof(line), stdin) != NULL && actionCount < SIM_ACTIONS_MAX)
+    {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if(line[0] == '#' || sscanf(line, "%lf %15s %n", &ms, word, &used) < 2)
+            continue;
+
+        a = &actions[actionCount];
+        a->when = ms * 1000;
+        a->text = NULL;
+
+        if(strcmp(word, "plug") == 0)
+            a->type = SIM_PLUG;
+        else if(strcmp(word, "unplug") == 0)
+            a->type = SIM_UNPLUG;
+        else if(strcmp(word, "launch") == 0)
+            a->type = SIM_LAUNCH;
+        else if(strcmp(word, "end") == 0)
+            a->type = SIM_END;
+        else if(strcmp(word, "type") == 0)
+        {
+            a->type = SIM_TYPE;
+            a->text = strdup(line + used);
+        }
+        else
+        {
+            fprintf(stderr, "sim: don't know how to %s\n", word);
+            continue;
+        }
+
+        if(actionCount > 0 && a->when < actions[actionCount - 1].when)
+            a->when = actions[actionCount - 1].when;
+        actionCount++;
+    }
+
+    // Without a script, stay plugged in until the firmware stops the run.
+    scripted = actionCount > 0;
+    if(!scripted)
+    {
+        actions[0].when = 0;
+        actions[0].type = SIM_PLUG;
+        actionCount = 1;
+    }
+}
+
+/* Loads the flash from the file named by BOB_SIM_FLASH, if there is one */
+static void SimLoadFlash(void)
+{
+    static uint8_t image[W25Q_MODEL_SIZE];
+    size_t len;
+    FILE *f;
+
+    flashPath = getenv("BOB_SIM_FLASH");
+    if(flashPath == NULL || (f = fopen(flashPath, "rb")) == NULL)
+        return;
+
+    len = fread(image, 1, sizeof(image), f);
+    fclose(f);
+    W25QModelLoad(image, len);
+}
+
+/* Sets up the chip before main() runs. main() is core 0. */
+__attribute__((constructor)) static void SimInit(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+
+    pthread_mutex_lock(&lock);
+    self = 0;
+    running = 0;
+    simCore = 0;
+    cores[0].started = true;
+
+    W25QModelReset();
+    SimLoadFlash();
+    SimLoadScript();
+    SimSetNow(0);
+    SimFireDue();
+}
+
+// Time
+
+uint64_t time_us_64(void)
+{
+    return simNow;
+}
+
+uint32_t time_us_32(void)
+{
+    return simNow;
+}
+
+absolute_time_t get_absolute_time(void)
+{
+    return simNow;
+}
+
+absolute_time_t make_timeout_time_us(uint64_t us)
+{
+    return simNow + us;
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms)
+{
+    return simNow + ms * 1000ull;
+}
+
+bool time_reached(absolute_time_t t)
+{
+    return simNow >= t;
+}
+
+void sleep_until(absolute_time_t t)
+{
+    if(t > simNow)
+        SimBlock(t, false);
+}
+
+void sleep_us(uint64_t us)
+{
+    SimSpend(us);
+}
+
+void sleep_ms(uint32_t ms)
+{
+    SimSpend(ms * 1000ull);
+}
+
+void busy_wait_us(uint64_t us)
+{
+    SimSpend(us);
+}
+
+/*  Sleeps until t, or until an event or interrupt comes in first.
+    Returns true if t was reached. */
+bool best_effort_wfe_or_timeout(absolute_time_t t)
+{
+    if(time_reached(t))
+        return true;
+
+    SimBlock(t, true);
+    return time_reached(t);
+}
+
+uint hardware_alarm_claim_unused(bool required)
+{
+    uint i;
+
+    for(i = 0; i < NUM_TIMERS; i++)
+    {
+        if(!(alarmsClaimed & 1u << i))
+        {
+            alarmsClaimed |= 1u << i;
+            return i;
+        }
+    }
+
+    if(required)
+    {
+        fprintf(stderr, "sim: no alarms left\n");
+        SimEnd();
+    }
+
+    return -1;
+}
+
+// Cores, events and interrupts
+
+uint get_core_num(void)
+{
+    return simCore;
+}
+
+void __wfe(void)
+{
+    SimBlock(SIM_FOREVER, true);
+}
+
+void __sev(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < SIM_CORES; i++)
+        cores[i].event = true;
+}
+
+void __dmb(void)
+{
+    __sync_synchronize();
+}
+
+void tight_loop_contents(void)
+{
+    SimSpend(1);
+}
+
+uint32_t save_and_disable_interrupts(void)
+{
+    bool was = cores[simCore].irqsOff;
+
+    cores[simCore].irqsOff = true;
+    return was;
+}
+
+void restore_interrupts(uint32_t status)
+{
+    cores[simCore].irqsOff = status;
+    if(!status)
+        SimDeliverIrqs();
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler)
+{
+    handlers[num] = handler;
+}
+
+void irq_set_enabled(uint num, bool enabled)
+{
+    if(enabled)
+    {
+        irqOwner[num] = simCore;
+        irqEnabled |= 1u << num;
+        SimDeliverIrqs();
+    }
+    else
+    {
+        irqEnabled &= ~(1u << num);
+    }
+}
+
+static void *SimCore1(void *entry)
+{
+    pthread_mutex_lock(&lock);
+    self = 1;
+    while(running != self)
+        pthread_cond_wait(&baton, &lock);
+
+    simCore = 1;
+    ((void (*)(void)) entry)();
+    return NULL;
+}
+
+/* Core 1 starts the next time core 0 waits on anything. */
+void multicore_launch_core1(void (*entry)(void))
+{
+    pthread_t thread;
+
+    cores[1].started = true;
+    cores[1].waiting = true;
+    cores[1].wakeable = false;
+    cores[1].until = simNow;
+
+    pthread_create(&thread, NULL, SimCore1, (void *) entry);
+}
+
+void multicore_fifo_push_blocking(uint32_t data)
+{
+    struct sim_core *to = &cores[simCore ^ 1];
+
+    while(to->fifoCount == SIM_FIFO_DEPTH)
+        __wfe();
+
+    to->fifo[(to->fifoHead + to->fifoCount++) % SIM_FIFO_DEPTH] = data;
+    __sev();
+}
+
+uint32_t multicore_fifo_pop_blocking(void)
+{
+    struct sim_core *c = &cores[simCore];
+    uint32_t data;
+
+    while(c->fifoCount == 0)
+        __wfe();
+
+    data = c->fifo[c->fifoHead];
+    c->fifoHead = (c->fifoHead + 1) % SIM_FIFO_DEPTH;
+    c->fifoCount--;
+    __sev();
+    return data;
+}
+
+// Flash
+
+void flash_do_cmd(const uint8_t *txbuf, uint8_t *rxbuf, size_t count)
+{
+    // The model keeps its own time, so catch it up first.
+    uint32_t behind = (uint32_t) simNow - W25QModelMicros();
+
+    if(behind < 0x80000000u)
+        W25QModelAdvance(behind);
+
+    W25QModelCmd(txbuf, rxbuf, count);
+    SimSpend(1 + count * 8 / FLASH_BITS_US);
+}
+
+// USB stdio
+
+/* Sends bytes to the host, if there is one. They take time to go. */
+static void SimUsbOut(const char *buf, int len)
+{
+    ssize_t n;
+
+    if(!plugged || len <= 0)
+        return;
+
+    cores[simCore].owed += len * USB_BYTE_US;
+    usbBytes += len;
+
+    while(len > 0 && (n = write(STDOUT_FILENO, buf, len)) > 0)
+    {
+        buf += n;
+        len -= n;
+    }
+}
+
+static ssize_t SimUsbWrite(void *cookie, const char *buf, size_t len)
+{
+    (void) cookie;
+    SimUsbOut(buf, len);
+    return len;
+}
+
+/* Raw output, like dumpFlash's, goes after anything printed before it. */
+static void SimUsbOutChars(const char *buf, int len)
+{
+    fflush(usbOut);
+    SimUsbOut(buf, len);
+}
+
+bool stdio_init_all(void)
+{
+    static const cookie_io_functions_t io = {.write = SimUsbWrite};
+
+    usbOut = fopencookie(NULL, "w", io);
+    setvbuf(usbOut, NULL, _IOFBF, 64);
+    stdout = usbOut;
+    stdio_usb.out_chars = SimUsbOutChars;
+    return true;
+}
+
+void stdio_flush(void)
+{
+    fflush(usbOut);
+}
+
+bool stdio_usb_connected(void)
+{
+    return plugged;
+}
+
+int getchar_timeout_us(uint32_t timeout)
+{
+    uint64_t deadline;
+    int c;
+
+    SimSpend(GETCHAR_POLL_US);
+    deadline = simNow + timeout;
+
+    while(inputCount == 0)
+    {
+        if(simNow >= deadline)
+            return PICO_ERROR_TIMEOUT;
+
+        // Nothing comes in until the next action.
+        SimBlock(nextAction < actionCount ? MIN(deadline, actions[nextAction].when) : deadline,
+                 false);
+    }
+
+    c = (unsigned char) input[inputHead];
+    inputHead = (inputHead + 1) % SIM_INPUT_MAX;
+    inputCount--;
+    return c;
+}
+
+void reset_usb_boot(uint32_t gpio_mask, uint32_t disable_interface_mask)
+{
+    (void) gpio_mask;
+    (void) disable_interface_mask;
+    SimEnd();
+}
@@ -0,0 +1,81 @@
+#include "qmc5883l_model.h"
+#include "flight_model.h"
+#include "qmc5883l.h"
+
+#include <string.h>
+
+#define QMC_REGS     0x0E
+#define QMC_NOISE    0.002f  // In gauss
+
+static const uint32_t periods[4] = {100000, 20000, 10000, 5000}; // By ODR, in us
+static const float lsbPerGauss[2] = {12000, 3000};               // By scale
+
+static uint8_t regs[QMC_REGS];
+static uint8_t pointer;
+
+/* Fills the output registers with the latest sample at now */
+static void QMCModelSample(uint64_t now)
+{
+    struct flight_state s;
+    uint8_t ctrl = regs[QMC_CONTROL1];
+    uint32_t period = periods[(ctrl >> QMC_ODR_SHIFT) & 0x03];
+    int16_t raw;
+    uint8_t i;
+
+    if(((ctrl >> QMC_MODE_SHIFT) & 0x03) != QMC_CONTINUOUS)
+        return;
+
+    FlightModelAt(now - now % period, &s);
+
+    for(i = 0; i < 3; i++)
+    {
+        raw = (s.mag[i] + QMC_NOISE * FlightModelNoise())
+              * lsbPerGauss[(ctrl >> QMC_SCALE_SHIFT) & 0x01];
+        regs[QMC_XOUT_LSB + 2 * i] = raw;
+        regs[QMC_XOUT_MSB + 2 * i] = raw >> 8;
+    }
+
+    regs[QMC_STATUS] = 1 << QMC_DRDY;
+}
+
+/*  A write of len bytes from buf, at now in us */
+void QMCModelWrite(uint64_t now, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    (void) now;
+    if(len == 0)
+        return;
+
+    pointer = buf[0] % QMC_REGS;
+    for(i = 1; i < len; i++)
+    {
+        regs[pointer] = buf[i];
+        if(pointer == QMC_CONTROL2 && buf[i] & 1 << QMC_SOFT_RST)
+            memset(regs, 0, sizeof(regs));
+        pointer = (pointer + 1) % QMC_REGS;
+    }
+}
+
+/*  A read of len bytes into buf, at now in us */
+void QMCModelRead(uint64_t now, uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    // Reading from the outputs gets them all from the same sample.
+    if(pointer <= QMC_ZOUT_MSB)
+        QMCModelSample(now);
+
+    for(i = 0; i < len; i++)
+    {
+        buf[i] = regs[pointer];
+        if(pointer == QMC_ZOUT_MSB)
+            regs[QMC_STATUS] &= ~(1 << QMC_DRDY);
+
+        // With pointer roll on, reads wrap around the outputs and status.
+        if(regs[QMC_CONTROL2] & 1 << QMC_ROL_PNT && pointer == QMC_STATUS)
+            pointer = QMC_XOUT_LSB;
+        else
+            pointer = (pointer + 1) % QMC_REGS;
+    }
+}
@@ -0,0 +1,18 @@
+/*  Model of the QMC5883L magnetometer, for running the firmware on a PC.
+
+    Has the chip's registers, and in continuous mode updates the output
+    registers at the ODR from flight_model.h. */
+
+#ifndef QMC5883L_MODEL_H
+#define QMC5883L_MODEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  A write of len bytes from buf, at now in us */
+void QMCModelWrite(uint64_t now, const uint8_t *buf, size_t len);
+
+/*  A read of len bytes into buf, at now in us */
+void QMCModelRead(uint64_t now, uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,251 @@
+#include "qmi8658c_model.h"
+#include "flight_model.h"
+#include "qmi8658c.h"
+
+#include <string.h>
+
+#define QMI_REGS        0x80
+#define QMI_FIFO_BYTES  (QMI_FIFO_MAX * 12)
+#define QMI_ACC_NOISE   0.01f   // In g
+#define QMI_GYRO_NOISE  0.1f    // In dps
+
+// FIFO_STATUS flags
+#define QMI_FIFO_FULL   (1 << 7)
+#define QMI_FIFO_WTM    (1 << 6)
+#define QMI_FIFO_NOT_EMPTY (1 << 4)
+
+static uint8_t regs[QMI_REGS];
+static uint8_t pointer;
+
+static uint8_t fifo[QMI_FIFO_BYTES];
+static size_t fifoHead;
+static size_t fifoLen;
+static uint64_t nextSample;  // When the next sample goes into the FIFO
+
+/* The sample period, from the accelerometer's ODR. With the gyro on too, the
+   gyro's clock sets it, at 7174.4 Hz halved for each step down. */
+static uint32_t QMIModelPeriod(void)
+{
+    uint8_t odr = MIN(regs[QMI_CTRL_ACC] & 0x0F, QMI_ACC_32HZ);
+
+    if(regs[QMI_CTRL_ENB] & QMI_GYRO_ENABLE)
+        return ((10000000ull << odr) + 35872) / 71744;
+    return 125u << odr;
+}
+
+/* Bytes in each sample in the FIFO */
+static size_t QMIModelFrame(void)
+{
+    return (regs[QMI_CTRL_ENB] & QMI_ACC_ENABLE ? 6 : 0)
+           + (regs[QMI_CTRL_ENB] & QMI_GYRO_ENABLE ? 6 : 0);
+}
+
+static size_t QMIModelFifoSize(void)
+{
+    return (16u << ((regs[QMI_FIFO_CTRL] >> QMI_FIFO_SIZE_SHIFT) & 0x03)) * QMIModelFrame();
+}
+
+static void QMIModelPut16(int16_t value)
+{
+    fifo[(fifoHead + fifoLen++) % QMI_FIFO_BYTES] = value;
+    fifo[(fifoHead + fifoLen++) % QMI_FIFO_BYTES] = value >> 8;
+}
+
+/* Adds a sample taken at t to the FIFO */
+static void QMIModelSample(uint64_t t)
+{
+    struct flight_state s;
+    uint8_t accScale = (regs[QMI_CTRL_ACC] >> QMI_SCALE_OFFSET) & 0x03;
+    uint8_t gyroScale = (regs[QMI_CTRL_GYRO] >> QMI_SCALE_OFFSET) & 0x07;
+    size_t frame = QMIModelFrame();
+    uint8_t i;
+
+    // Once full, a stream FIFO drops its oldest sample, and a FIFO FIFO
+    // stops taking any more.
+    if(fifoLen + frame > QMIModelFifoSize())
+    {
+        if((regs[QMI_FIFO_CTRL] & 0x03) != QMI_FIFO_STREAM)
+            return;
+        fifoHead = (fifoHead + frame) % QMI_FIFO_BYTES;
+        fifoLen -= frame;
+    }
+
+    FlightModelAt(t, &s);
+
+    if(regs[QMI_CTRL_ENB] & QMI_ACC_ENABLE)
+    {
+        for(i = 0; i < 3; i++)
+            QMIModelPut16((s.accel[i] + QMI_ACC_NOISE * FlightModelNoise()) * (1 << (14 - accScale)));
+    }
+
+    if(regs[QMI_CTRL_ENB] & QMI_GYRO_ENABLE)
+    {
+        for(i = 0; i < 3; i++)
+            QMIModelPut16((s.gyro[i] + QMI_GYRO_NOISE * FlightModelNoise()) * (2048 >> gyroScale));
+    }
+}
+
+/* Fills the FIFO with the samples taken up to now */
+static void QMIModelUpdate(uint64_t now)
+{
+    uint32_t period = QMIModelPeriod();
+    size_t frame = QMIModelFrame();
+    uint64_t behind;
+
+    if((regs[QMI_FIFO_CTRL] & 0x03) == QMI_FIFO_BYPASS || frame == 0)
+    {
+        nextSample = MAX(nextSample, now);
+        return;
+    }
+
+    // Anything older than a FIFO's worth would only be pushed out again.
+    behind = QMIModelFifoSize() / frame * period;
+    if(nextSample + behind < now)
+        nextSample = now - behind;
+
+    for(; nextSample <= now; nextSample += period)
+        QMIModelSample(nextSample);
+}
+
+/* Brings FIFO_SMPL_CNT and FIFO_STATUS up to date */
+static void QMIModelCount(void)
+{
+    size_t words = fifoLen / 2;
+
+    regs[QMI_FIFO_SMPL_CNT] = words;
+    regs[QMI_FIFO_STATUS] = (words >> 8 & 0x03)
+                            | (fifoLen > 0 ? QMI_FIFO_NOT_EMPTY : 0)
+                            | (fifoLen >= QMIModelFifoSize() ? QMI_FIFO_FULL : 0);
+}
+
+static void QMIModelReset(void)
+{
+    memset(regs, 0, sizeof(regs));
+    regs[QMI_WHO_AM_I] = 0x05;
+    regs[QMI_WHO_AM_I + 1] = 0x7C; // Revision
+    fifoLen = 0;
+}
+
+/* Writes a register, doing whatever writing it does */
+static void QMIModelSet(uint64_t now, uint8_t reg, uint8_t value)
+{
+    // Samples up to now were taken with the old settings. Changing the ODR
+    // or what's enabled starts the FIFO's timing over.
+    QMIModelUpdate(now);
+    if(reg == QMI_CTRL_ACC || reg == QMI_CTRL_ENB)
+        nextSample = now;
+
+    regs[reg] = value;
+
+    switch(reg)
+    {
+    case QMI_CTRL_CMD:
+        if(value == QMI_CMD_ACK)
+        {
+            regs[QMI_STATUSINT] &= ~QMI_CMD_DONE;
+            break;
+        }
+
+        if(value == QMI_CMD_RST_FIFO)
+            fifoLen = 0;
+        else if(value == QMI_CMD_REQ_FIFO)
+            regs[QMI_FIFO_CTRL] |= QMI_FIFO_RD_MODE;
+        regs[QMI_STATUSINT] |= QMI_CMD_DONE;
+        break;
+    case QMI_RESET:
+        if(value == 0xB0)
+            QMIModelReset();
+        break;
+    default:
+        break;
+    }
+}
+
+/* Reads a register, doing whatever reading it does */
+static uint8_t QMIModelGet(uint8_t reg)
+{
+    uint8_t value;
+
+    if(reg != QMI_FIFO_DATA)
+        return regs[reg];
+
+    if(fifoLen == 0)
+        return 0;
+
+    value = fifo[fifoHead];
+    fifoHead = (fifoHead + 1) % QMI_FIFO_BYTES;
+    fifoLen--;
+    return value;
+}
+
+/* Fills the output registers with a sample at now */
+static void QMIModelOutputs(uint64_t now)
+{
+    struct flight_state s;
+    uint8_t accScale = (regs[QMI_CTRL_ACC] >> QMI_SCALE_OFFSET) & 0x03;
+    uint8_t gyroScale = (regs[QMI_CTRL_GYRO] >> QMI_SCALE_OFFSET) & 0x07;
+    uint32_t stamp = now / QMIModelPeriod();
+    int16_t raw;
+    uint8_t i;
+
+    FlightModelAt(now, &s);
+
+    regs[QMI_TIMESTAMP_LSB] = stamp;
+    regs[QMI_TIMESTAMP_MID] = stamp >> 8;
+    regs[QMI_TIMESTAMP_MSB] = stamp >> 16;
+    regs[QMI_TEMP_LSB] = 0;
+    regs[QMI_TEMP_MSB] = s.temp;
+
+    for(i = 0; i < 3; i++)
+    {
+        raw = s.accel[i] * (1 << (14 - accScale));
+        regs[QMI_ACC_X_LSB + 2 * i] = raw;
+        regs[QMI_ACC_X_MSB + 2 * i] = raw >> 8;
+        raw = s.gyro[i] * (2048 >> gyroScale);
+        regs[QMI_GYRO_X_LSB + 2 * i] = raw;
+        regs[QMI_GYRO_X_MSB + 2 * i] = raw >> 8;
+    }
+}
+
+/*  A write of len bytes from buf, at now in us */
+void QMIModelWrite(uint64_t now, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    if(regs[QMI_WHO_AM_I] == 0)
+        QMIModelReset();
+
+    if(len == 0)
+        return;
+
+    pointer = buf[0] % QMI_REGS;
+    for(i = 1; i < len; i++)
+    {
+        QMIModelSet(now, pointer, buf[i]);
+        if(regs[QMI_CTRL_IF] & QMI_ADDR_AI)
+            pointer = (pointer + 1) % QMI_REGS;
+    }
+}
+
+/*  A read of len bytes into buf, at now in us */
+void QMIModelRead(uint64_t now, uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    if(regs[QMI_WHO_AM_I] == 0)
+        QMIModelReset();
+
+    QMIModelUpdate(now);
+    QMIModelCount();
+    if(pointer >= QMI_TIMESTAMP_LSB && pointer <= QMI_GYRO_Z_MSB)
+        QMIModelOutputs(now);
+
+    for(i = 0; i < len; i++)
+    {
+        buf[i] = QMIModelGet(pointer);
+
+        // FIFO_DATA stays put, so the whole FIFO can be read in one go.
+        if(regs[QMI_CTRL_IF] & QMI_ADDR_AI && pointer != QMI_FIFO_DATA)
+            pointer = (pointer + 1) % QMI_REGS;
+    }
+}
@@ -0,0 +1,21 @@
+/*  Model of the QMI8658C IMU, for running the firmware on a PC.
+
+    Has the registers, commands and FIFO the driver uses. Samples go into
+    the FIFO at the accelerometer's ODR, read off flight_model.h, and are
+    only worked out when something looks at the FIFO, so an idle IMU costs
+    nothing. The gyro is assumed to run at the same ODR, and with it on,
+    both run at the chip's real 6DOF rates (896.8 Hz for "1 kHz"). */
+
+#ifndef QMI8658C_MODEL_H
+#define QMI8658C_MODEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*  A write of len bytes from buf, at now in us */
+void QMIModelWrite(uint64_t now, const uint8_t *buf, size_t len);
+
+/*  A read of len bytes into buf, at now in us */
+void QMIModelRead(uint64_t now, uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,62 @@
+/*  Runs the firmware on a PC, for testing and benchmarking without a board.
+
+    The headers in sim/include stand in for the Pico SDK's, and pico_sim.c,
+    i2c_sim.c and the models behind them stand in for the chip, the flash
+    and the sensors. Nothing in src/ or lib/ changes to run here.
+
+    Time is virtual. Each core is a thread, but only one runs at a time, and
+    code takes no time at all except where the chip would wait: sleeping,
+    waiting for an event, spinning in tight_loop_contents, or talking to the
+    flash, the I2C bus or USB. When both cores are waiting, time jumps
+    straight to the next thing that wakes one of them, so a run takes as long
+    as the work in it rather than the time it covers, and the same script
+    always gives the same result.
+
+    What happens is set by a script read from stdin, one action a line:
+
+        <ms> plug           Plug USB in. Output goes to stdout while it is.
+        <ms> unplug
+        <ms> type <text>    Type text into the console, e.g. "type t. 0 5000"
+        <ms> launch         Start the flight; see flight_model.h
+        <ms> end            Stop the run. Without one, it stops after the
+                            last action.
+
+    Lines starting with # are comments. USB starts plugged in. With no
+    actions at all (e.g. stdin is /dev/null), USB stays plugged in and the
+    run goes on until the firmware calls SimEnd() or reset_usb_boot().
+    If BOB_SIM_FLASH is set, the flash is loaded from the file it names
+    when there is one, and saved back to it at the end, so a log can be
+    carried over from one run to the next. */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_FOREVER UINT64_MAX
+
+/*  Returns the time since boot, in us */
+uint64_t SimMicros(void);
+
+/*  Keeps the calling core busy for us, letting the other core and any
+    interrupts run meanwhile. */
+void SimSpend(uint64_t us);
+
+/*  Calls fn at time when, from the scheduler, as if it were hardware.
+    Returns false if too many are already waiting. */
+bool SimSchedule(uint64_t when, void (*fn)(void));
+
+/*  Raises IRQ num. Its handler runs straight away if the core that enabled
+    it can take it, or as soon as it can otherwise. */
+void SimRaiseIrq(unsigned num);
+
+/*  Stops the run, printing how it went to stderr. */
+void SimEnd(void);
+
+/*  Returns how many bytes have gone over the I2C bus, and for how long it
+    has been busy in us. */
+void SimI2CStats(uint64_t *bytes, uint64_t *busyUs);
+
+#endif
@@ -0,0 +1,200 @@
+#include "w25q64_model.h"
+#include "w25q64.h"
+
+#include <string.h>
+
+static uint8_t memory[W25Q_MODEL_SIZE];
+static uint32_t now;
+static uint32_t violations;
+
+static bool wel;            // Write enable latch
+static uint32_t progEnd;    // When the page program running ends
+
+static uint32_t eraseSector = W25Q_IDLE; // Sector being erased
+static uint32_t eraseEnd;   // When the erase ends, if it's running
+static uint32_t eraseLeft;  // Time the erase has left, if it's suspended
+static bool suspended;
+static bool resetEnabled;   // W25Q_ENABLE_RESET was the last command
+static uint32_t suspendEnd; // When the suspend takes effect
+
+/* Finishes whatever has finished by now */
+static void W25QModelUpdate(void)
+{
+    if(eraseSector != W25Q_IDLE && !suspended && (int32_t)(now - eraseEnd) >= 0)
+    {
+        memset(memory + eraseSector, 0xFF, W25Q_SECTOR_SIZE);
+        eraseSector = W25Q_IDLE;
+    }
+}
+
+static bool W25QModelBusy(void)
+{
+    if((int32_t)(now - progEnd) < 0)
+        return true;
+
+    if(eraseSector == W25Q_IDLE)
+        return false;
+
+    return suspended ? (int32_t)(now - suspendEnd) < 0 : true;
+}
+
+static uint32_t W25QModelAddr(const uint8_t *tx)
+{
+    return (tx[1] << 16 | tx[2] << 8 | tx[3]) % W25Q_MODEL_SIZE;
+}
+
+/*  Resets the model to a blank chip at time 0 */
+void W25QModelReset(void)
+{
+    memset(memory, 0xFF, sizeof(memory));
+    now = 0;
+    violations = 0;
+    wel = false;
+    progEnd = 0;
+    eraseSector = W25Q_IDLE;
+    suspended = false;
+    resetEnabled = false;
+}
+
+/*  Fills the chip from the start with len bytes of data, as if it had been
+    programmed with them, e.g. to pick up a log saved from an earlier run */
+void W25QModelLoad(const uint8_t *data, size_t len)
+{
+    memcpy(memory, data, MIN(len, sizeof(memory)));
+}
+
+/*  Clocks tx out to the chip and rx in, count bytes each way */
+void W25QModelCmd(const uint8_t *tx, uint8_t *rx, size_t count)
+{
+    uint32_t addr;
+    bool enabled;
+    size_t i;
+
+    now++;
+    W25QModelUpdate();
+    memset(rx, 0xFF, count);
+
+    if(count == 0)
+        return;
+
+    // Only status reads, suspend and reset go through while busy.
+    if(W25QModelBusy() && tx[0] != W25Q_READ_SR1 && tx[0] != W25Q_READ_SR2
+       && tx[0] != W25Q_SUSPEND && tx[0] != W25Q_ENABLE_RESET && tx[0] != W25Q_RESET)
+    {
+        violations++;
+        return;
+    }
+
+    enabled = resetEnabled;
+    resetEnabled = tx[0] == W25Q_ENABLE_RESET;
+
+    switch(tx[0])
+    {
+    case W25Q_READ_SR1:
+        if(count > 1)
+            rx[1] = (W25QModelBusy() ? W25Q_SR1_BUSY : 0) | (wel ? W25Q_SR1_WEL : 0);
+        break;
+    case W25Q_READ_SR2:
+        if(count > 1)
+            rx[1] = suspended ? W25Q_SR2_SUS : 0;
+        break;
+    case W25Q_WRITE_ENABLE:
+        wel = true;
+        break;
+    case W25Q_READ_DATA:
+        addr = W25QModelAddr(tx);
+        for(i = 4; i < count; i++)
+            rx[i] = memory[(addr + i - 4) % W25Q_MODEL_SIZE];
+        break;
+    case W25Q_PAGE_PROGRAM:
+        addr = W25QModelAddr(tx);
+        if(!wel || count < 4 || (suspended && (addr & ~(W25Q_SECTOR_SIZE - 1)) == eraseSector))
+        {
+            violations++;
+            break;
+        }
+
+        // Programming only clears bits, and wraps around within the page.
+        for(i = 4; i < count && i < 4 + W25Q_PAGE_SIZE; i++)
+        {
+            memory[(addr & ~(W25Q_PAGE_SIZE - 1)) | ((addr + i - 4) & (W25Q_PAGE_SIZE - 1))]
+                &= tx[i];
+        }
+
+        progEnd = now + W25Q_MODEL_T_PP;
+        wel = false;
+        break;
+    case W25Q_SECTOR_ERASE:
+        if(!wel || count < 4 || suspended)
+        {
+            violations++;
+            break;
+        }
+
+        eraseSector = W25QModelAddr(tx) & ~(W25Q_SECTOR_SIZE - 1);
+        eraseEnd = now + W25Q_MODEL_T_SE;
+        wel = false;
+        break;
+    case W25Q_SUSPEND:
+        if(eraseSector != W25Q_IDLE && !suspended)
+        {
+            suspended = true;
+            eraseLeft = eraseEnd - now;
+            suspendEnd = now + W25Q_T_SUS;
+        }
+        break;
+    case W25Q_RESUME:
+        if(suspended)
+        {
+            suspended = false;
+            eraseEnd = now + eraseLeft;
+        }
+        break;
+    case W25Q_ENABLE_RESET:
+        break;
+    case W25Q_RESET:
+        // Only goes through straight after it's enabled.
+        if(!enabled)
+        {
+            violations++;
+            break;
+        }
+
+        // Whatever was running is abandoned, leaving the sector or page
+        // part done. The part done isn't modelled.
+        eraseSector = W25Q_IDLE;
+        suspended = false;
+        wel = false;
+        progEnd = now + W25Q_T_RST;
+        break;
+    default:
+        violations++;
+        break;
+    }
+}
+
+/*  Returns the model's time in us */
+uint32_t W25QModelMicros(void)
+{
+    return now;
+}
+
+/*  Moves the model's time on by us */
+void W25QModelAdvance(uint32_t us)
+{
+    now += us;
+    W25QModelUpdate();
+}
+
+/*  Returns the contents of the chip, as XIP would see it */
+const uint8_t *W25QModelMemory(void)
+{
+    return memory;
+}
+
+/*  Returns the number of commands the real chip would've ignored or done
+    something undefined with. */
+uint32_t W25QModelViolations(void)
+{
+    return violations;
+}
@@ -0,0 +1,47 @@
+/*  Model of the W25Q64 flash chip, for running the firmware on a PC.
+
+    W25QModelCmd takes commands the same way flash_do_cmd does, so it can be
+    given to W25QInit in place of the real chip. Time only moves when the
+    model is told it has: each command takes a microsecond, and
+    W25QModelAdvance moves it on by more.
+
+    Erase, program and suspend timings follow the datasheet's typical
+    figures. Anything the datasheet says is ignored or undefined, like
+    reading while busy or programming into a sector that's being erased,
+    is counted in W25QModelViolations so it can be checked for. */
+
+#ifndef W25Q64_MODEL_H
+#define W25Q64_MODEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define W25Q_MODEL_SIZE  (8 * 1024 * 1024)
+#define W25Q_MODEL_T_SE  45000   // Sector erase time in us
+#define W25Q_MODEL_T_PP  700     // Page program time in us
+
+/*  Resets the model to a blank chip at time 0 */
+void W25QModelReset(void);
+
+/*  Fills the chip from the start with len bytes of data, as if it had been
+    programmed with them, e.g. to pick up a log saved from an earlier run */
+void W25QModelLoad(const uint8_t *data, size_t len);
+
+/*  Clocks tx out to the chip and rx in, count bytes each way */
+void W25QModelCmd(const uint8_t *tx, uint8_t *rx, size_t count);
+
+/*  Returns the model's time in us */
+uint32_t W25QModelMicros(void);
+
+/*  Moves the model's time on by us */
+void W25QModelAdvance(uint32_t us);
+
+/*  Returns the contents of the chip, as XIP would see it */
+const uint8_t *W25QModelMemory(void);
+
+/*  Returns the number of commands the real chip would've ignored or done
+    something undefined with. */
+uint32_t W25QModelViolations(void);
+
+#endif
@@ -1,4 +1,5 @@
 #include "stdio.h"
+#include "string.h"
 
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
@@ -8,6 +9,7 @@
 
 #include "ansi.h"
 #include "sampler.h"
+#include "trace.h"
 
 enum states {
     PLUGGED_IN,  // Connected to USB
@@ -18,30 +20,56 @@ enum states {
 };
 
 enum states state = PLUGGED_IN;
-uint32_t readIndex = 0;
+struct log_cursor readCursor;
+sample_t sample;
 
 void cmdInterpreter(void);
 
-sample_t sampleAndLog(uint8_t freq);
+void sampleAndLog(sample_t * sample, enum log_mode mode);
+
+void printEvery(sample_t * sample, char * msg, uint32_t ms);
+
+void printErase(int8_t progress);
+
+uint8_t readSession(void);
+
+bool readNumber(uint32_t * value);
 
 int main() {
-    sample_t sample;
+    char line[SAMPLE_CSV_MAX];
+    int lastState = -1;
 
     stdio_init_all();
     configureSensors();
 
     while (true) {
+        if(state != lastState) {
+            TRACE_MARK("state", state);
+            lastState = state;
+        }
+
         switch (state) {
         case PLUGGED_IN:
             // State transition logic
             state = stdio_usb_connected() ? PLUGGED_IN : LOG;
             printf(SHOWC);
             cmdInterpreter();
+
+            // Keep up with core 1, so the debug prompt starts with fresh data.
+            getSample(&sample, LOG_NONE);
+
+            // Nothing else is going on, so get the old log out of the way.
+            printErase(eraseAhead(true));
             break;
         case LOG:
             state = stdio_usb_connected() ? PLUGGED_IN : LOG;
 
-            sampleAndLog(100);
+            // Nothing goes to flash until launch, so waiting on the pad
+            // doesn't use any of it up.
+            sampleAndLog(&sample, LOG_LAUNCH);
+            eraseAhead(false);
+            if(state != LOG)
+                flushSamples();
 
             break;
         case DEBUG_PRINT:
@@ -50,9 +78,8 @@ int main() {
             // Return to PLUGGED_IN if the user presses a key
             state = getchar_timeout_us(0) == PICO_ERROR_TIMEOUT ? DEBUG_PRINT : PLUGGED_IN;
 
-            sample = getSample();
-            prettyPrint(sample, "Press any key to exit");
-            sleep_ms(100);
+            best_effort_wfe_or_timeout(getSample(&sample, LOG_NONE));
+            printEvery(&sample, "Press any key to exit", 100);
 
             break;
         case DEBUG_LOG:
@@ -61,44 +88,109 @@ int main() {
             // Return to PLUGGED_IN if the user presses a key
             state = getchar_timeout_us(0) == PICO_ERROR_TIMEOUT ? DEBUG_LOG : PLUGGED_IN;
 
-            sample = sampleAndLog(100);
-            prettyPrint(sample, "Press any key to stop logging");
+            sampleAndLog(&sample, LOG_ALWAYS);
+            eraseAhead(false);
+            printEvery(&sample, "Press any key to stop logging", 100);
+            if(state != DEBUG_LOG)
+                flushSamples();
 
             break;
         case DATA_OUT:
             // If unplugged, go to LOG
             state = stdio_usb_connected() ? DEBUG_PRINT : LOG;
             // If we're out of data, go to PLUGGED_IN
-            state = readSample(readIndex, &sample) ? PLUGGED_IN : DATA_OUT;
+            state = readSample(&readCursor, &sample) ? PLUGGED_IN : DATA_OUT;
 
-            printf("%u, %d, %u, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\n",
-                   sample.time, sample.status, sample.pres, sample.temp,
-                   sample.mag[0], sample.mag[1], sample.mag[2],
-                   sample.accel[0], sample.accel[1], sample.accel[2],
-                   sample.gyro[0], sample.gyro[1], sample.gyro[2]);
+            formatSample(line, sizeof(line), &sample);
+            fputs(line, stdout);
 
-            readIndex++;
             break;
         }
     }
 }
 
-/* Takes and logs a sample, sleeps to ensure samples are taken at the desired
- * frequency. Returns the logged sample for processing if needed. */
-sample_t sampleAndLog(uint8_t freq) {
-    sample_t sample;
-    absolute_time_t nextPoll;
+/* Polls and logs whichever sensors are due, then sleeps until the next one is
+ * or a read finishes. The latest readings are left in sample for processing
+ * if needed. */
+void sampleAndLog(sample_t * sample, enum log_mode mode) {
+    absolute_time_t next = getSample(sample, mode);
+
+    TRACE_BEGIN("wait");
+    best_effort_wfe_or_timeout(next);
+    TRACE_END("wait");
+}
+
+/* Prints the debug prompt, at most once every ms milliseconds.
+ * The sensors can be polled far faster than a terminal can keep up with. */
+void printEvery(sample_t * sample, char * msg, uint32_t ms) {
+    static absolute_time_t nextPrint = 0;
+
+    if(time_reached(nextPrint)) {
+        TRACE_BEGIN("prettyPrint");
+        prettyPrint(*sample, msg);
+        TRACE_END("prettyPrint");
+        nextPrint = make_timeout_time_ms(ms);
+    }
+}
+
+/* Prints how far through erasing the old log we are, when it changes.
+ * Sectors that are already blank are skipped without a percentage, so it
+ * can jump ahead, but it's only done once the whole flash is. */
+void printErase(int8_t progress) {
+    static int8_t last = ERASE_DONE;
+
+    if(progress >= 0 && progress != last) {
+        printf("\rErasing old log: %3d%%", progress);
+        last = progress;
+    } else if(progress == ERASE_DONE && last >= 0) {
+        printf("\rErasing old log: done\n");
+        last = ERASE_DONE;
+    }
+}
+
+/* Reads the session number after a command. Sessions are listed in hex, so
+ * they fit in one key, and . is the latest.
+ * Returns SESSION_NONE if it isn't one. */
+uint8_t readSession(void) {
+    int c = getchar_timeout_us(1000000);
+
+    if(c == '.')
+        return SESSION_LATEST;
+    else if(c >= '0' && c <= '9')
+        return c - '0';
+    else if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    else
+        return SESSION_NONE;
+}
+
+/* Reads a decimal number typed after a command, skipping spaces before it.
+ * Returns false if there wasn't one. */
+bool readNumber(uint32_t * value) {
+    int c;
+
+    do {
+        c = getchar_timeout_us(1000000);
+    } while(c == ' ');
+
+    if(c < '0' || c > '9')
+        return false;
 
-    nextPoll = make_timeout_time_ms(1000/freq);
-    sample = getSample();
-    logSample(sample);
-    sleep_until(nextPoll);
+    *value = 0;
+    while(c >= '0' && c <= '9') {
+        *value = *value * 10 + c - '0';
+        c = getchar_timeout_us(1000000);
+    }
 
-    return sample;
+    return true;
 }
 
 /* Interprets and executes commands being given over STDIN */
 void cmdInterpreter(void) {
+    uint8_t session;
+    int c;
+    uint32_t from;
+    uint32_t to;
 
     static const char helpText[] =
         "Bob Rev 3 running build: %s %s\n"
@@ -106,9 +198,18 @@ void cmdInterpreter(void) {
         "b to enter bootsel mode\n"
         "c to clear the contents of the flash\n"
         "d to show the debug prompt\n"
+        "f then a session number to dump just that session in binary,\n"
+        "  or f. for the latest\n"
+        "g to dump the trace of where the time went (see drivers/traceDump.py)\n"
         "h to display this help text\n"
         "l to start manual logging\n"
-        "r to read files\n";
+        "p then a session and a level to preview the session's summaries\n"
+        "  (0: 100 ms, 1: 1 s, 2: 10 s), e.g. p.1\n"
+        "r to read files\n"
+        "s to list the logging sessions\n"
+        "t then a session, and a start and end time in ms, to read just the\n"
+        "  records between them, e.g. t. 12000 32000\n"
+        "x to dump files in binary (see drivers/dumpData.py)\n";
 
     // Interpret commands
     switch(getchar_timeout_us(0)) {
@@ -123,9 +224,42 @@ void cmdInterpreter(void) {
         state = DEBUG_LOG;
         break;
     case 'r':
-        readIndex = 0;
+        seekLog(&readCursor);
+        memset(&sample, 0, sizeof(sample));
         state = DATA_OUT;
         break;
+    case 'x':
+        dumpFlash();
+        break;
+    case 's':
+        listSessions();
+        break;
+    case 'f':
+        dumpSession(readSession());
+        break;
+    case 'g':
+        TraceDump();
+        break;
+    case 'p':
+        session = readSession();
+        c = getchar_timeout_us(1000000);
+        if(c < '0' || c >= '0' + SUMMARY_LEVELS)
+            printf("Usage: p<session><level>\n");
+        else if(!previewSession(session, c - '0'))
+            printf("No such session\n");
+        break;
+    case 't':
+        // t<session> <from> <to>, times in ms since boot
+        session = readSession();
+        if(!readNumber(&from) || !readNumber(&to)) {
+            printf("Usage: t<session> <from ms> <to ms>\n");
+        } else if(!seekTime(&readCursor, session, from, to)) {
+            printf("No such session\n");
+        } else {
+            memset(&sample, 0, sizeof(sample));
+            state = DATA_OUT;
+        }
+        break;
     case 'c':
         printf(NORM
                "Are you sure you wish to clear the flash? "
@@ -136,7 +270,7 @@ void cmdInterpreter(void) {
             printf("Timed out due to lack of response, please try again\n");
             break;
         case 'y':
-            printf("Clearing flash. (This may take a while) \n");
+            // The old log is erased in the background from here.
             clearFlash();
             printf("Done!\n");
             break;
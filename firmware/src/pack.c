@@ -0,0 +1,209 @@
+#include "pack.h"
+
+#include <pico/stdlib.h>
+#include <string.h>
+
+/* Reads a column out of a record, widened to 32 bits. */
+static uint32_t getColumn(const uint8_t * record, const struct column * col) {
+    int16_t half;
+    uint32_t word;
+
+    if (col->size == 2) {
+        memcpy(&half, record + col->offset, 2);
+        return (uint32_t)(int32_t) half;
+    }
+
+    memcpy(&word, record + col->offset, 4);
+    return word;
+}
+
+/* Writes a column into a record, truncated to its size. */
+static void setColumn(uint8_t * record, const struct column * col, uint32_t value) {
+    int16_t half = value;
+
+    if (col->size == 2)
+        memcpy(record + col->offset, &half, 2);
+    else
+        memcpy(record + col->offset, &value, 4);
+}
+
+/* Difference between two values, zigzag encoded: 0, -1, 1, -2... become
+ * 0, 1, 2, 3... Wraps around, so it works for unsigned columns too. */
+static uint32_t zigzag(uint32_t value, uint32_t prev) {
+    int32_t diff = value - prev;
+    return ((uint32_t) diff << 1) ^ (uint32_t)(diff >> 31);
+}
+
+static uint32_t unzigzag(uint32_t zz) {
+    return (zz >> 1) ^ -(zz & 1);
+}
+
+/* Number of bits needed to hold value. */
+static uint8_t bitWidth(uint32_t value) {
+    return value ? 32 - __builtin_clz(value) : 0;
+}
+
+/* Size of the fixed part of a block: first values and widths. */
+static uint16_t headerSize(const struct layout * layout) {
+    uint16_t size = layout->count;
+    uint8_t i;
+
+    for (i = 0; i < layout->count; i++)
+        size += layout->columns[i].size;
+
+    return size;
+}
+
+static void putBits(uint8_t * buf, uint32_t * pos, uint32_t value, uint8_t width) {
+    uint8_t shift;
+    uint8_t take;
+
+    while (width > 0) {
+        shift = *pos & 7;
+        take = MIN(width, 8 - shift);
+
+        buf[*pos >> 3] |= (value & ((1u << take) - 1)) << shift;
+
+        value >>= take;
+        width -= take;
+        *pos += take;
+    }
+}
+
+static uint32_t getBits(const uint8_t * buf, uint32_t * pos, uint8_t width) {
+    uint32_t value = 0;
+    uint8_t done = 0;
+    uint8_t shift;
+    uint8_t take;
+
+    while (done < width) {
+        shift = *pos & 7;
+        take = MIN(width - done, 8 - shift);
+
+        value |= (uint32_t)((buf[*pos >> 3] >> shift) & ((1u << take) - 1)) << done;
+
+        done += take;
+        *pos += take;
+    }
+
+    return value;
+}
+
+/* Sets up packer to fill blocks of space bytes with records laid out as
+ * layout. records must have room for capacity of them, which is at most
+ * PACK_MAX_RECORDS. */
+void packInit(struct packer * packer, const struct layout * layout,
+              uint16_t space, void * records, uint8_t capacity) {
+    packer->layout = layout;
+    packer->space = space;
+    packer->count = 0;
+    packer->capacity = MIN(capacity, PACK_MAX_RECORDS);
+    packer->records = records;
+    memset(packer->width, 0, sizeof(packer->width));
+}
+
+/* Adds a record to the block, if it fits.
+ * Works out how wide each column would need to be with the record added,
+ * which is only a few instructions a column, so the block never has to be
+ * packed twice. Returns true if it was added, or false if the block is full. */
+bool packAdd(struct packer * packer, const void * record) {
+    const struct layout * layout = packer->layout;
+    const uint8_t * prev;
+    uint8_t width[PACK_MAX_COLUMNS];
+    uint32_t bits = 0;
+    uint8_t i;
+
+    if (packer->count == packer->capacity)
+        return false;
+
+    if (packer->count > 0) {
+        prev = packer->records + (packer->count - 1) * layout->size;
+        for (i = 0; i < layout->count; i++) {
+            width[i] = MAX(packer->width[i],
+                           bitWidth(zigzag(getColumn(record, &layout->columns[i]),
+                                           getColumn(prev, &layout->columns[i]))));
+            bits += width[i];
+        }
+
+        // count differences so far, plus this one
+        if (headerSize(layout) * 8 + bits * packer->count > packer->space * 8u)
+            return false;
+
+        memcpy(packer->width, width, layout->count);
+    }
+
+    memcpy(packer->records + packer->count * layout->size, record, layout->size);
+    packer->count++;
+    return true;
+}
+
+/* Writes out the block, and empties the packer for the next one.
+ * buf must hold space bytes. Returns the number of records in the block. */
+uint8_t packWrite(struct packer * packer, uint8_t * buf) {
+    const struct layout * layout = packer->layout;
+    const struct column * col;
+    uint8_t count = packer->count;
+    uint32_t pos;
+    uint8_t i;
+    uint8_t j;
+
+    memset(buf, 0, packer->space);
+
+    for (i = 0; i < layout->count; i++) {
+        col = &layout->columns[i];
+        memcpy(buf, packer->records + col->offset, col->size);
+        buf += col->size;
+    }
+
+    memcpy(buf, packer->width, layout->count);
+    buf += layout->count;
+
+    pos = 0;
+    for (i = 0; i < layout->count; i++) {
+        col = &layout->columns[i];
+        for (j = 1; j < count; j++) {
+            putBits(buf, &pos, zigzag(getColumn(packer->records + j * layout->size, col),
+                                      getColumn(packer->records + (j - 1) * layout->size, col)),
+                    packer->width[i]);
+        }
+    }
+
+    packer->count = 0;
+    memset(packer->width, 0, sizeof(packer->width));
+    return count;
+}
+
+/* Unpacks count records from a block written by packWrite into records. */
+void unpack(const struct layout * layout, const uint8_t * buf,
+            uint8_t count, void * records) {
+    const struct column * col;
+    const uint8_t * width;
+    uint8_t * out = records;
+    uint32_t value;
+    uint32_t pos;
+    uint8_t i;
+    uint8_t j;
+
+    memset(records, 0, count * layout->size);
+    if (count == 0)
+        return;
+
+    for (i = 0; i < layout->count; i++) {
+        col = &layout->columns[i];
+        memcpy(out + col->offset, buf, col->size);
+        buf += col->size;
+    }
+
+    width = buf;
+    buf += layout->count;
+
+    pos = 0;
+    for (i = 0; i < layout->count; i++) {
+        col = &layout->columns[i];
+        value = getColumn(out, col);
+        for (j = 1; j < count; j++) {
+            value += unzigzag(getBits(buf, &pos, width[i]));
+            setColumn(out + j * layout->size, col, value);
+        }
+    }
+}
@@ -2,24 +2,473 @@
 #include "hp203b.h"
 #include "qmc5883l.h"
 #include "qmi8658c.h"
+#include "i2cq.h"
+#include "w25q64.h"
+#include "pack.h"
 #include "ansi.h"
+#include "trace.h"
 
 #include <pico/stdlib.h>
 #include <hardware/i2c.h>
 #include <hardware/flash.h>
+#include <hardware/sync.h>
+#include <hardware/timer.h>
+#include <hardware/irq.h>
+#include <pico/multicore.h>
+#include <pico/stdio_usb.h>
 #include <string.h>
+#include <assert.h>
 
 #define PROG_RESERVED (1024 * 1024)
 
+// The start of the log area holds a couple of sectors of metadata, and the
+// log itself follows.
+#define META_START   PROG_RESERVED
+#define META_SECTORS 2
+#define LOG_START    (META_START + META_SECTORS * FLASH_SECTOR_SIZE)
+#define ERASE_AHEAD  (64 * 1024) // How far ahead of the cursor to erase while logging
+#define ERASE_SLICE  2000        // How long an erase runs for before it's suspended, in us
+#define STAGE_PAGES  4
+#define RING_RECORDS 128  // Records in flight from core 1 to core 0
+#define JITTER_BUCKETS 64 // How late polls start is kept as a histogram of
+#define JITTER_SHIFT   3  // buckets 8 us wide; the last takes the rest
+#define DUMP_PAGES   16   // Pages sent in each frame by dumpFlash()
+#define DUMP_MAGIC   0x504D5544 // "DUMP", marks the start of a frame
+
+// Fast-mode. All three sensors are only rated for 400 kHz, so Fast-mode Plus
+// (1 MHz) is out of spec.
+#define I2C_BAUD (400 * 1000)
+
 #define GYRO_RANGE QMI_GYRO_256DPS
 #define ACCL_RANGE QMI_ACC_16G
+#define ACCL_LSB_G 2048   // Raw accelerometer reading of 1 g at ACCL_RANGE
+#define MAG_SCALE  QMC_SCALE_2G
+
+// Most IMU samples drained at once. Every phase's drain period needs to
+// leave room in this for a late drain.
+#define IMU_FIFO  64
+
+// Summaries are kept over buckets of these lengths, in ms.
+#define SUMMARY_PERIODS { 100, 1000, 10000 }
+#define SUMMARY_RECORDS 16    // Most summaries a page can take
+
+// Waiting for launch, the last PRETRIGGER_PAGES pages are kept in SRAM rather
+// than flash, which is 11 s or more of every stream at the pad rates. Launch is when
+// the acceleration stays over LAUNCH_G for LAUNCH_MS. After launch they're
+// programmed RELEASE_PAGES at a time between the live pages, so core 1's ring
+// isn't left waiting on all of them at once.
+#define PRETRIGGER_PAGES 64
+#define RELEASE_PAGES    2
+#define LAUNCH_G         3
+#define LAUNCH_MS        50
+
+// The rest of the flight is worked out the same way. Burnout is when the
+// acceleration stays under BURNOUT_G for BURNOUT_MS. Apogee is when the
+// pressure, smoothed over about APOGEE_SMOOTH readings, has stayed APOGEE_PA
+// above its lowest for APOGEE_MS. Landing is when the pressure has stayed
+// within LANDED_PA for LANDED_MS.
+#define BURNOUT_G     1
+#define BURNOUT_MS    100
+#define APOGEE_PA     50    // ~4 m
+#define APOGEE_SMOOTH 4
+#define APOGEE_MS     200
+#define LANDED_PA   30
+#define LANDED_MS   10000
+
+#define HZ(rate) (1000000 / (rate)) // Period in us
+
+// With the gyro on, the QMI's ODRs come from the gyro's clock, 7174.4 Hz halved
+// for each step down, rather than the round numbers they're named for: "1 kHz"
+// is 896.8 Hz. Its samples are timed by this, so it's the real period, in us.
+#define QMI_PERIOD(odr) ((uint32_t)(((10000000ull << (odr)) + 35872) / 71744))
+
+// Once less than DECIMATE_FROM of the log is left, only one in two of each
+// stream's records is logged, then one in four below half that, and so on
+// down to one in DECIMATE_MAX, except during boost and coast. The last
+// LOG_RESERVE of the log only takes summaries and events, so even a long
+// wait to be found still leaves the shape of it.
+#define DECIMATE_FROM ((PICO_FLASH_SIZE_BYTES - LOG_START) / 2)
+#define DECIMATE_MAX  8
+#define LOG_RESERVE   (64 * 1024)
+
+// How fast each sensor is polled in each phase. The IMU samples into its
+// FIFO at its ODR, which is drained every drain period; the barometer runs
+// conversions back to back, but no faster than its period. Core 1 reads this,
+// so it's kept in RAM.
+struct rates {
+    uint32_t imuPeriod;       // us between IMU samples, to match the ODRs
+    enum QMIAccelODR accOdr;
+    enum QMIGyroODR gyroOdr;
+    uint32_t drainPeriod;     // us between IMU FIFO drains
+    enum QMCODR magOdr;
+    uint32_t magPeriod;       // us between compass reads
+    enum HP203_OSR baroOsr;
+    uint32_t baroPeriod;      // Shortest time between barometer conversions, in us
+};
+
+static const struct rates __not_in_flash("acquire") phaseRates[PHASE_COUNT] = {
+    //                IMU                                                      Drain     Compass                  Barometer
+    [PHASE_GROUND]  = { QMI_PERIOD(QMI_ACC_500HZ), QMI_ACC_500HZ, QMI_GYRO_500HZ, HZ(50),  QMC_ODR_100HZ, HZ(100), HP203_OSR_256,  0 },
+    [PHASE_PAD]     = { QMI_PERIOD(QMI_ACC_125HZ), QMI_ACC_125HZ, QMI_GYRO_125HZ, HZ(10),  QMC_ODR_10HZ,  HZ(10),  HP203_OSR_1024, HZ(2) },
+    [PHASE_BOOST]   = { QMI_PERIOD(QMI_ACC_1KHZ),  QMI_ACC_1KHZ,  QMI_GYRO_1KHZ,  HZ(50),  QMC_ODR_200HZ, HZ(200), HP203_OSR_256,  0 },
+    [PHASE_COAST]   = { QMI_PERIOD(QMI_ACC_1KHZ),  QMI_ACC_1KHZ,  QMI_GYRO_1KHZ,  HZ(50),  QMC_ODR_200HZ, HZ(200), HP203_OSR_256,  0 },
+    [PHASE_DESCENT] = { QMI_PERIOD(QMI_ACC_250HZ), QMI_ACC_250HZ, QMI_GYRO_250HZ, HZ(25),  QMC_ODR_50HZ,  HZ(50),  HP203_OSR_512,  0 },
+    [PHASE_LANDED]  = { QMI_PERIOD(QMI_ACC_32HZ),  QMI_ACC_32HZ,  QMI_GYRO_32HZ,  HZ(2),   QMC_ODR_10HZ,  HZ(1),   HP203_OSR_4096, HZ(1) }
+};
+
+static const char * const phaseNames[PHASE_COUNT] = {
+    "Ground", "Pad", "Boost", "Coast", "Descent", "Landed"
+};
 
 // Sensor structs
 static hp203_t hp203;
 static qmc_t qmc;
 static qmi_t qmi;
+static w25q_t flash;
+
+/* Pages are programmed one at a time, in order, so a power cut can only tear
+ * the last one. seq and crc are filled in just before a page is programmed,
+ * so a torn or misplaced page can be told from a good one. */
+struct page_hdr {
+    uint8_t stream;   // Stream the records are from. 0xFF if the page is blank.
+    uint8_t count;    // Number of records in the page
+    uint16_t epoch;   // Log the page belongs to. Stale if it isn't the current one.
+    uint32_t seq;     // Page number from the start of the log
+    uint32_t crc;     // CRC32 of the page up to here, then the data
+};
+
+// The records in a page are packed column by column; see pack.h.
+typedef union {
+    struct {
+        struct page_hdr hdr;
+        uint8_t data[FLASH_PAGE_SIZE - sizeof(struct page_hdr)];
+    };
+    uint8_t raw[FLASH_PAGE_SIZE];
+} page_t;
+
+static_assert(sizeof(page_t) == FLASH_PAGE_SIZE, "page_t must be one flash page");
+
+/* Clearing the flash starts a new log, with a new epoch, rather than erasing
+ * anything. Pages from older logs are ignored, and sectors are erased just
+ * ahead of the cursor as the new log needs them.
+ * Each time the epoch changes, it is written to the next page of the meta
+ * sectors. When one sector fills up, the other is erased and used instead,
+ * so the current epoch is never lost part way through an erase.
+ * The entry also holds the LOG_LAYOUT the log was written with. Firmware
+ * with another layout can't read it, so starts a new log at boot. */
+struct meta_entry {
+    uint16_t epoch;   // Only ever 0 to 0xFFFE, as in page_hdr
+    uint16_t layout;  // LOG_LAYOUT. Entries from before it read as 0.
+    uint32_t check;   // ~ the two above as one word, so leftovers of an old
+                      // log aren't mistaken for one
+};
+
+// Goes up whenever the page header, the record columns or the meta page
+// change, so a log is never read back with the wrong layout.
+#define LOG_LAYOUT 1
+
+/* Each time logging starts, a session is added to the directory in the rest
+ * of the epoch's meta page. Blank flash can be programmed a bit at a time, so
+ * entries are filled in as they're needed: the start when the session opens,
+ * and the record count when it's closed. A session cut short by a power cut
+ * never gets its count, so it's worked out from the page headers instead.
+ * A session runs until the next one starts, or to the end of the log. */
+struct session {
+    uint32_t page;      // First page, from the start of the log. 0xFFFFFFFF if unused.
+    uint32_t start;     // Time since boot of the first record, in ms
+    uint32_t records;   // Records in the session. 0xFFFFFFFF if never closed.
+    uint8_t accRange;   // Sensor config, to scale the raw readings with
+    uint8_t gyroRange;
+    uint8_t magScale;
+    uint8_t baroOsr;
+};
+
+#define META_SESSIONS ((FLASH_PAGE_SIZE - sizeof(struct meta_entry) - sizeof(uint64_t)) \
+                       / (sizeof(struct session) + 1))
+
+/* A power cut while an erase is suspended leaves the sector part erased,
+ * and it can read back blank without being. The log is erased in order, and
+ * each ERASE_CHUNK of it is marked off in the meta page once it's done, so
+ * after a reboot only the chunk after the last mark can hold such a sector.
+ * Sectors in it are erased whether they look blank or not. */
+#define ERASE_MARKS 64
+#define ERASE_CHUNK ((((PICO_FLASH_SIZE_BYTES - LOG_START) / FLASH_SECTOR_SIZE + ERASE_MARKS - 1) \
+                      / ERASE_MARKS) * FLASH_SECTOR_SIZE)
+
+struct meta_page {
+    struct meta_entry entry;
+    struct session sessions[META_SESSIONS];
+    uint64_t erased;  // Bit n is cleared once chunk n of the log is erased
+    // The sensor streams with pages in each session, a bit each, filled in
+    // when it's closed. 0xFF if never closed. Kept apart from the sessions
+    // so they stay 16 bytes.
+    uint8_t streams[META_SESSIONS];
+};
+
+static_assert(sizeof(struct meta_page) <= FLASH_PAGE_SIZE, "meta_page must fit in a flash page");
+
+#define META_PAGES (META_SECTORS * FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define NO_SESSION 0xFF
+
+// How each stream's records are split into columns for packing.
+static const struct column imuColumns[] = {
+    COLUMN(imu_record_t, time),
+    COLUMN(imu_record_t, accel[0]),
+    COLUMN(imu_record_t, accel[1]),
+    COLUMN(imu_record_t, accel[2]),
+    COLUMN(imu_record_t, gyro[0]),
+    COLUMN(imu_record_t, gyro[1]),
+    COLUMN(imu_record_t, gyro[2]),
+    COLUMN(imu_record_t, missed)
+};
+
+static const struct column magColumns[] = {
+    COLUMN(mag_record_t, time),
+    COLUMN(mag_record_t, mag[0]),
+    COLUMN(mag_record_t, mag[1]),
+    COLUMN(mag_record_t, mag[2]),
+    COLUMN(mag_record_t, missed)
+};
+
+static const struct column baroColumns[] = {
+    COLUMN(baro_record_t, time),
+    COLUMN(baro_record_t, pres),
+    COLUMN(baro_record_t, temp),
+    COLUMN(baro_record_t, missed)
+};
+
+#define MIN_MAX_MEAN(type, field) \
+    COLUMN(type, field[0]), COLUMN(type, field[1]), COLUMN(type, field[2])
+
+static const struct column summaryColumns[] = {
+    COLUMN(summary_record_t, time),
+    COLUMN(summary_record_t, level),
+    MIN_MAX_MEAN(summary_record_t, accel[0]),
+    MIN_MAX_MEAN(summary_record_t, accel[1]),
+    MIN_MAX_MEAN(summary_record_t, accel[2]),
+    MIN_MAX_MEAN(summary_record_t, gyro[0]),
+    MIN_MAX_MEAN(summary_record_t, gyro[1]),
+    MIN_MAX_MEAN(summary_record_t, gyro[2]),
+    MIN_MAX_MEAN(summary_record_t, mag[0]),
+    MIN_MAX_MEAN(summary_record_t, mag[1]),
+    MIN_MAX_MEAN(summary_record_t, mag[2]),
+    MIN_MAX_MEAN(summary_record_t, pres),
+    MIN_MAX_MEAN(summary_record_t, temp),
+    COLUMN(summary_record_t, records[STREAM_IMU]),
+    COLUMN(summary_record_t, records[STREAM_MAG]),
+    COLUMN(summary_record_t, records[STREAM_BARO]),
+    COLUMN(summary_record_t, missed[STREAM_IMU]),
+    COLUMN(summary_record_t, missed[STREAM_MAG]),
+    COLUMN(summary_record_t, missed[STREAM_BARO]),
+    COLUMN(summary_record_t, late[STREAM_IMU]),
+    COLUMN(summary_record_t, late[STREAM_MAG]),
+    COLUMN(summary_record_t, late[STREAM_BARO])
+};
+
+static_assert(count_of(summaryColumns) <= PACK_MAX_COLUMNS, "too many summary columns");
+
+static const struct column eventColumns[] = {
+    COLUMN(event_record_t, time),
+    COLUMN(event_record_t, phase),
+    COLUMN(event_record_t, imuOdr),
+    COLUMN(event_record_t, magRate),
+    COLUMN(event_record_t, baroOsr),
+    COLUMN(event_record_t, keep)
+};
+
+static const struct layout layouts[STREAM_COUNT] = {
+    [STREAM_IMU]     = { imuColumns,     count_of(imuColumns),     sizeof(imu_record_t) },
+    [STREAM_MAG]     = { magColumns,     count_of(magColumns),     sizeof(mag_record_t) },
+    [STREAM_BARO]    = { baroColumns,    count_of(baroColumns),    sizeof(baro_record_t) },
+    [STREAM_SUMMARY] = { summaryColumns, count_of(summaryColumns), sizeof(summary_record_t) },
+    [STREAM_EVENT]   = { eventColumns,   count_of(eventColumns),   sizeof(event_record_t) }
+};
 
-static sample_t * writePtr = (sample_t *)(XIP_BASE + PROG_RESERVED);
+/* Summaries are worked out on core 0 as records are logged. Each channel's
+ * readings are gathered into a bucket at each level, and when a reading
+ * comes after the end of a bucket, the bucket is logged as a summary record.
+ * Each level has its own packer, so its pages only hold the one level. A
+ * sensor with no readings in a bucket repeats its last reading. */
+#define CHANNELS 11   // accel[3], gyro[3], mag[3], pres, temp
+
+struct bucket {
+    uint32_t start;   // Start time in ms, or UINT32_MAX if empty
+    uint16_t count[SENSOR_COUNT];
+    uint16_t missed[SENSOR_COUNT];
+    uint16_t late[SENSOR_COUNT];
+    int32_t min[CHANNELS];
+    int32_t max[CHANNELS];
+    int64_t sum[CHANNELS];
+};
+
+// Room for a page's worth of any stream's records.
+typedef union {
+    imu_record_t imu[PACK_MAX_RECORDS];
+    mag_record_t mag[PACK_MAX_RECORDS];
+    baro_record_t baro[PACK_MAX_RECORDS];
+} page_records_t;
+
+static void acquire(void);
+static void flashCmd(const uint8_t * tx, uint8_t * rx, size_t count);
+static uint32_t flashMicros(void);
+
+// Scheduling and timing stats for each stream.
+struct stream {
+    const char * name;
+    uint32_t period;         // Poll period in us
+    bool paced;              // Sensor sets its own pace; the poll sets next
+    absolute_time_t next;    // When the stream is next due
+    uint32_t polls;
+    uint32_t overruns;       // Number of polls missed entirely
+    uint32_t maxLate;        // Worst time a poll started after it was due, in us
+    uint32_t maxBusy;        // Worst time a poll took to finish, in us
+    uint64_t totalBusy;      // All of them added up, for the mean
+    uint32_t maxFlashLate;   // Worst maxLate while flash was being written, in us
+    uint32_t jitter[JITTER_BUCKETS]; // How late each poll started, as a histogram
+    uint16_t late;           // How late the last poll started, in us
+    uint16_t missed;         // Polls missed since the last record
+    uint32_t records;        // Records logged, and the pages they took up
+    uint32_t pages;
+    uint32_t dropped;        // Records dropped because core 0 fell behind
+    bool busy;               // Reads have been queued but haven't finished
+    absolute_time_t started; // When the reads were queued
+};
+
+static struct stream streams[SENSOR_COUNT] = {
+    [STREAM_IMU]  = { .name = "IMU" },
+    [STREAM_MAG]  = { .name = "Compass" },
+    [STREAM_BARO] = { .name = "Baro",    .period = HZ(10), .paced = true }
+};
+
+// Transfers and buffers for the reads each stream queues
+static struct qmi_fifo_read imuRead;
+static struct i2cq_xfer magXfer;
+static uint8_t magBuf[QMC_MAG_LEN];
+static struct i2cq_xfer baroXfer[2];
+static uint8_t baroBuf[HP203_DATA_LEN];
+static bool converting = false;  // The barometer has a conversion running
+static uint64_t convStart;       // When the conversion started, in us
+static enum HP203_OSR convOsr;   // The OSR it was started with
+
+/* Sampling and logging are split across the cores. Core 1 polls the sensors
+ * and passes records to core 0 through ring, and core 0 stages them and
+ * programs flash. Only core 1 moves head and only core 0 moves tail.
+ *
+ * Everything core 1 runs is kept in RAM, so it carries on while flash is
+ * being programmed or erased. That rules out most of the SDK's time functions,
+ * memcpy and division, which all live in flash. Core 1 timestamps records in
+ * us, and core 0 turns them into ms. */
+struct record {
+    uint8_t stream;
+    uint64_t time;    // Time since boot in us
+    uint16_t late;    // How late the poll that made it started, in us
+    uint16_t missed;  // Polls of the stream missed since its last record
+    union {
+        imu_record_t imu;
+        mag_record_t mag;
+        baro_record_t baro;
+    };
+};
+
+static struct record ring[RING_RECORDS];
+static volatile uint16_t ringHead = 0;
+static volatile uint16_t ringTail = 0;
+
+static uint acqAlarm;                  // Hardware alarm core 1 sleeps on
+static volatile bool flashBusy = false; // Core 0 is writing to flash
+
+/* Core 0 works out the phase, and core 1 changes the compass and barometer
+ * rates to match straight away. The IMU's wait until it next drains the
+ * FIFO, so the samples left in it are timed right. */
+static volatile uint8_t wantPhase = PHASE_GROUND; // Set by core 0
+static uint8_t ratesPhase = PHASE_GROUND;         // Phase core 1's rates are for
+static uint8_t imuPhase = PHASE_GROUND;           // The same for the IMU's
+static uint32_t imuPeriod;                        // us between IMU samples
+static enum HP203_OSR baroOsr;
+static uint32_t baroPeriod;                       // Shortest time between conversions
+static struct i2cq_xfer ratesXfer[3];
+
+// The records each stream has for its next page, and how they're packing.
+static page_records_t openRecords[SENSOR_COUNT];
+static struct packer packers[SENSOR_COUNT];
+
+// The same for each level of summaries, and the buckets being filled.
+static summary_record_t summaryRecords[SUMMARY_LEVELS][SUMMARY_RECORDS];
+static struct packer summaryPackers[SUMMARY_LEVELS];
+static struct bucket buckets[SUMMARY_LEVELS];
+static int32_t lastReading[CHANNELS];
+
+// Pages logged before launch. The oldest is preCount pages behind preHead.
+static page_t preRing[PRETRIGGER_PAGES];
+static uint8_t preHead = 0;
+static uint8_t preCount = 0;
+static bool holding = false;    // Pages go to preRing rather than flash
+static bool launched = false;   // Launch has been seen since the last flushSamples()
+
+// Working out the phase
+static enum flight_phase phase = PHASE_GROUND;
+static uint32_t heldSince = UINT32_MAX; // When the condition for the next phase started holding
+static uint32_t minPres;                // Lowest smoothed pressure since launch
+static uint32_t smoothPres;             // Pressure the apogee check is comparing
+static uint32_t landedPres;             // Pressure the landing check is comparing to
+
+// How many records of each stream go by for each one logged, and the count
+// of them so far.
+static uint16_t keep = 1;
+static uint32_t kept[SENSOR_COUNT];
+
+// Events are committed as soon as they're logged, so they only need room for one.
+static event_record_t eventRecords[1];
+static struct packer eventPacker;
+
+// The last page readSample() unpacked.
+static page_records_t readRecords;
+static uint32_t readPage = UINT32_MAX;
+
+// Ring of full pages in SRAM waiting to be programmed, oldest at the tail.
+static page_t stage[STAGE_PAGES];
+static uint8_t stageHead = 0;
+static uint8_t stageTail = 0;
+
+// Flash offset the tail page will be programmed to. 0 until we've found it.
+static uint32_t flashPage = 0;
+static uint32_t erasedTo = 0;   // Flash from flashPage up to here is known to be blank
+static uint32_t eraseCheckFrom = 0; // From here up to eraseCheckTo, blank looking
+static uint32_t eraseCheckTo = 0;   // sectors are erased anyway
+static uint16_t epoch;          // Epoch of the current log
+static uint16_t metaPage;       // Meta page the current epoch is in
+static bool sessionOpen = false; // Logging since the last flushSamples()
+static uint8_t session = NO_SESSION; // Directory entry of the open session
+static uint32_t sessionRecords; // Records logged in the open session
+static uint8_t sessionStreams;  // Sensor streams with pages in it, a bit each
+static uint32_t progTime = 0;   // Longest page program so far, in us
+static uint64_t progTotal = 0;  // All page programs added up, and how many
+static uint32_t progCount = 0;
+static uint32_t progFails = 0;  // Page programs the flash didn't finish
+static uint32_t pagesLost = 0;  // Pages dropped because failures filled the staging ring
+static bool progRetry = false;  // The tail page's last program failed
+static uint32_t tornPages = 0;  // Torn pages found at the end of the log at boot
+static uint32_t cursorTime = 0; // Time taken to find flashPage, in us
+static uint32_t firstTime = 0;  // Time since boot the first record was logged, in us
+
+/* How late 99% of a stream's polls started by, at most, in us. Only as
+ * close as the width of a jitter bucket, and never more than the worst. */
+static uint32_t lateP99(const struct stream * s) {
+    uint32_t total = 0;
+    uint32_t seen = 0;
+    uint8_t i;
+
+    for (i = 0; i < JITTER_BUCKETS; i++)
+        total += s->jitter[i];
+
+    for (i = 0; i < JITTER_BUCKETS - 1; i++) {
+        seen += s->jitter[i];
+        if (seen * 100ull >= total * 99ull)
+            return MIN((uint32_t)(i + 1) << JITTER_SHIFT, s->maxLate);
+    }
+
+    return s->maxLate;
+}
 
 /* Takes a sample and a message and prints it to the console in
  * a nice pretty format */
@@ -27,7 +476,7 @@ void prettyPrint(sample_t s, char * msg) {
     static const char prompt[] =
         MOV(1,1) NORM
         "Bob Rev 3 running build: %s %s" CLRLN
-        "Timestamp: %u" CLRLN
+        "Timestamp: %llu us" CLRLN
         CLRLN
         "Accelerometer: X: %6d     Y: %6d     Z: %6d" "\n"
         NORM
@@ -37,31 +486,151 @@ void prettyPrint(sample_t s, char * msg) {
         NORM // Alacritty *really* likes to bold stuff.
         "Barometer:     Pressure: %7u Pa     Temp: %6d" "\n"
         NORM
-        "Flash:         Used: %6u kiB"
+        "Flash:         Used: %6u kiB     Program: %5u us     Torn: %u     Failed: %u     Lost: %u" "\n"
+        NORM
+        "Boot:          Cursor: %6u us     First sample: %7u us" "\n"
+        NORM
+        "Phase:         %-8s         Logging 1 in %u"
         CLRLN NORM
-        "%s.\x1b[0J\n";
+        "%-10s %6s %8s %8s %8s %8s %8s %8s %8s %7s" CLRLN;
 
+    static const char streamLine[] =
+        NORM "%-10s %6u %8u %8u %8u %8u %8u %8u %8u %7u" CLRLN;
 
-    uint32_t bytesUsed = (int) writePtr - (XIP_BASE + PROG_RESERVED);
+    uint32_t bytesUsed = flashPage > LOG_START ? flashPage - LOG_START : 0;
     uint32_t kiBUsed = bytesUsed >> 10;
+    uint8_t i;
 //  float temp = (float)s.temp / 100;
 
-    printf(prompt, __TIME__, __DATE__, s.time,
+    printf(prompt, __TIME__, __DATE__, (unsigned long long) s.micros,
            s.accel[0], s.accel[1], s.accel[2],
            s.gyro[0], s.gyro[1], s.gyro[2],
            s.mag[0], s.mag[1], s.mag[2],
-           s.pres, s.temp, kiBUsed, msg);
+           s.pres, s.temp, kiBUsed, progTime, tornPages, progFails, pagesLost,
+           cursorTime, firstTime, phaseNames[phase], keep,
+           "Stream", "Hz", "Polls", "Overruns", "Late us", "p99 us", "Busy us",
+           "Dropped", "Flash us", "Rec/pg");
+
+    for(i = 0; i < SENSOR_COUNT; i++) {
+        printf(streamLine, streams[i].name,
+               streams[i].period ? 1000000 / streams[i].period : 0,
+               streams[i].polls, streams[i].overruns,
+               streams[i].maxLate, lateP99(&streams[i]),
+               streams[i].maxBusy, streams[i].dropped,
+               streams[i].maxFlashLate,
+               streams[i].pages ? streams[i].records / streams[i].pages : 0);
+    }
+
+    printf(NORM "%s.\x1b[0J\n", msg);
+}
 
+/* Writes s into buf as a line of the CSV 'r' prints, newline and all.
+ * Returns the length of the line, as snprintf() does. */
+int formatSample(char * buf, size_t len, const sample_t * s) {
+    return snprintf(buf, len,
+                    "%u, %d, %u, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\n",
+                    s->time, s->status, s->pres, s->temp,
+                    s->mag[0], s->mag[1], s->mag[2],
+                    s->accel[0], s->accel[1], s->accel[2],
+                    s->gyro[0], s->gyro[1], s->gyro[2]);
 }
 
+/* Copies the timing stats into stats. */
+void getStats(struct sampler_stats * stats) {
+    uint8_t i;
+
+    for(i = 0; i < SENSOR_COUNT; i++) {
+        stats->streams[i].name = streams[i].name;
+        stats->streams[i].polls = streams[i].polls;
+        stats->streams[i].overruns = streams[i].overruns;
+        stats->streams[i].maxLate = streams[i].maxLate;
+        stats->streams[i].p99Late = lateP99(&streams[i]);
+        stats->streams[i].maxBusy = streams[i].maxBusy;
+        stats->streams[i].totalBusy = streams[i].totalBusy;
+        stats->streams[i].records = streams[i].records;
+        stats->streams[i].pages = streams[i].pages;
+        stats->streams[i].dropped = streams[i].dropped;
+    }
+
+    stats->programs = progCount;
+    stats->programFails = progFails;
+    stats->pagesLost = pagesLost;
+    stats->maxProgram = progTime;
+    stats->totalProgram = progTotal;
+}
+
+/* Zeroes the timing stats. Core 1 keeps updating the stream stats while
+ * this runs, so a poll that finishes at the same time may be lost. */
+void resetStats(void) {
+    uint8_t i;
+
+    for(i = 0; i < SENSOR_COUNT; i++) {
+        streams[i].polls = 0;
+        streams[i].overruns = 0;
+        streams[i].maxLate = 0;
+        streams[i].maxBusy = 0;
+        streams[i].totalBusy = 0;
+        streams[i].maxFlashLate = 0;
+        memset(streams[i].jitter, 0, sizeof(streams[i].jitter));
+        streams[i].records = 0;
+        streams[i].pages = 0;
+        streams[i].dropped = 0;
+    }
+
+    progCount = 0;
+    progFails = 0;
+    pagesLost = 0;
+    progTime = 0;
+    progTotal = 0;
+}
+
+
+/* Empties a summary bucket. */
+static void resetBucket(struct bucket * b) {
+    uint8_t i;
+
+    b->start = UINT32_MAX;
+    memset(b->count, 0, sizeof(b->count));
+    memset(b->missed, 0, sizeof(b->missed));
+    memset(b->late, 0, sizeof(b->late));
+    for(i = 0; i < CHANNELS; i++) {
+        b->min[i] = INT32_MAX;
+        b->max[i] = INT32_MIN;
+        b->sum[i] = 0;
+    }
+}
+
+/* Empties every stream's next page, and the summaries. */
+static void resetPackers(void) {
+    page_t * page;
+    uint8_t i;
+
+    for(i = 0; i < SENSOR_COUNT; i++)
+        packInit(&packers[i], &layouts[i], sizeof(page->data), &openRecords[i],
+                 PACK_MAX_RECORDS);
+
+    for(i = 0; i < SUMMARY_LEVELS; i++) {
+        packInit(&summaryPackers[i], &layouts[STREAM_SUMMARY], sizeof(page->data),
+                 summaryRecords[i], SUMMARY_RECORDS);
+        resetBucket(&buckets[i]);
+    }
+
+    packInit(&eventPacker, &layouts[STREAM_EVENT], sizeof(page->data),
+             eventRecords, count_of(eventRecords));
+}
 
 /* Initialises the sensors and the associated i2c bus */
 void configureSensors(void)
 {
+    const struct rates * r = &phaseRates[PHASE_GROUND];
     struct qmc_cfg qmcCfg;
+    uint8_t i;
+
+    // The flash isn't a sensor, but its driver needs setting up too.
+    flash = W25QInit(flashCmd, flashMicros);
 
     // Configure the i2c bus.
-    i2c_init(i2c_default, 100 * 1000);
+    i2c_init(i2c_default, I2C_BAUD);
     gpio_set_function(16, GPIO_FUNC_I2C);
     gpio_set_function(17, GPIO_FUNC_I2C);
     gpio_pull_up(16);
@@ -73,112 +642,1742 @@ void configureSensors(void)
     qmi = QMIInit(i2c_default, true);
 
     // Configure the QMI's gyro
-    QMIGyroConfig(&qmi, QMI_GYRO_125HZ, GYRO_RANGE);
+    QMIGyroConfig(&qmi, r->gyroOdr, GYRO_RANGE);
     QMISetOption(&qmi, QMI_GYRO_ENABLE, true);
     QMISetOption(&qmi, QMI_GYRO_SNOOZE, false);
 
     // Configure the QMI's accelerometer
-    QMIAccConfig(&qmi, QMI_ACC_125HZ, ACCL_RANGE);
+    QMIAccConfig(&qmi, r->accOdr, ACCL_RANGE);
     QMISetOption(&qmi, QMI_ACC_ENABLE, true);
 
+    // Buffer the QMI's samples in its FIFO, so we only need to wake up to
+    // drain it. Once full, the oldest samples are dropped. The watermark
+    // isn't used, so it's left where the ground rates would put it.
+    QMIFifoConfig(&qmi, QMI_FIFO_STREAM, QMI_FIFO_64, r->drainPeriod / r->imuPeriod);
+
     // Configure the QMC
     qmcCfg.mode = QMC_CONTINUOUS;
-    qmcCfg.ODR = QMC_ODR_100HZ;
+    qmcCfg.ODR = r->magOdr;
     qmcCfg.OSR = QMC_OSR_256;
-    qmcCfg.scale = QMC_SCALE_2G;
+    qmcCfg.scale = MAG_SCALE;
     qmcCfg.pointerRoll = true;
     qmcCfg.enableInterrupt = false;
 
     QMCSetCfg(&qmc, qmcCfg);
 
+    // Start at the ground rates. Core 1 changes them from here on.
+    imuPeriod = r->imuPeriod;
+    baroOsr = r->baroOsr;
+    baroPeriod = r->baroPeriod;
+    streams[STREAM_IMU].period = r->drainPeriod;
+    streams[STREAM_MAG].period = r->magPeriod;
+
+    // Everything is due straight away.
+    resetPackers();
+    for(i = 0; i < SENSOR_COUNT; i++) {
+        streams[i].next = get_absolute_time();
+    }
+
+    // From here on the sensors belong to core 1. Wait for it to set up, as
+    // that still runs from flash.
+    multicore_launch_core1(acquire);
+    multicore_fifo_pop_blocking();
 }
 
-/* Gets a sample from the sensors.
- * No longer attempts to determine if sensors are functional.
- * If they don't respond, they dont respond. */
-sample_t getSample(void) {
-    sample_t sample = {0};
-    int32_t i2cStatus;
-    absolute_time_t hp203Ready;
+/* Carries on a CRC32 (the zlib/Ethernet one) over len more bytes of buf.
+ * Start with crc = 0. */
+static uint32_t crc32(uint32_t crc, const uint8_t * buf, size_t len) {
+    static uint32_t table[256];
+    uint32_t c;
+    uint16_t i;
+    uint8_t j;
 
-    struct hp203_data barometer;
-    struct qmi_data imu;
+    if (table[1] == 0) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (j = 0; j < 8; j++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+/* The CRC a page should have in its header. */
+static uint32_t pageCrc(const page_t * page) {
+    uint32_t crc = crc32(0, page->raw, offsetof(struct page_hdr, crc));
+    return crc32(crc, page->data, sizeof(page->data));
+}
+
+/* Checks that page n of the log was programmed whole, for this log, where
+ * it is. */
+static bool pageIntact(uint32_t n) {
+    const page_t * page = (const page_t *)(XIP_BASE + LOG_START) + n;
+
+    return page->hdr.epoch == epoch && page->hdr.seq == n && page->hdr.crc == pageCrc(page);
+}
+
+/* Checks that page n of the log has never been programmed. */
+static bool pageBlank(uint32_t n) {
+    const uint32_t * word = (const uint32_t *)(XIP_BASE + LOG_START + n * FLASH_PAGE_SIZE);
+    uint16_t i;
+
+    for (i = 0; i < FLASH_PAGE_SIZE / 4; i++) {
+        if (word[i] != 0xFFFFFFFF)
+            return false;
+    }
+
+    return true;
+}
+
+/* Programs a page of flash. Core 1 runs from RAM, so it carries on sampling
+ * meanwhile.
+ * Returns the same as W25QProgram. Failures are counted in progFails. */
+static int8_t programPage(uint32_t offset, const uint8_t * data) {
+    uint32_t ints;
+    int8_t result;
+
+    TRACE_BEGIN("programPage");
+    flashBusy = true;
+    ints = save_and_disable_interrupts();
+    result = W25QProgram(&flash, offset, data);
+    restore_interrupts(ints);
+    flashBusy = false;
+    TRACE_END("programPage");
+
+    if (result != W25Q_OK)
+        progFails++;
+
+    return result;
+}
+
+/* How the flash driver talks to the chip. The SDK's flash_do_cmd takes care
+ * of getting out of XIP and back again. */
+static void __not_in_flash_func(flashCmd)(const uint8_t * tx, uint8_t * rx, size_t count) {
+    flash_do_cmd(tx, rx, count);
+}
+
+static uint32_t __not_in_flash_func(flashMicros)(void) {
+    return timer_hw->timerawl;
+}
+
+/* Runs the erase of the sector at offset for ERASE_SLICE us, starting it if
+ * it hasn't been started. While it's suspended between slices the rest of
+ * the flash can be read and programmed, so at most one slice of interrupts
+ * off at a time rather than the ~45 ms a whole erase takes.
+ * Returns the same as W25QErase. */
+static int8_t eraseSlice(uint32_t offset) {
+    uint32_t ints;
+    int8_t result;
+
+    TRACE_BEGIN("eraseSlice");
+    flashBusy = true;
+    ints = save_and_disable_interrupts();
+    result = W25QErase(&flash, offset, ERASE_SLICE);
+    restore_interrupts(ints);
+    flashBusy = false;
+    TRACE_END("eraseSlice");
+
+    return result;
+}
+
+/* Returns true if the sector at offset is already blank. Don't use on the
+ * sector being erased, which can't be read while it's suspended. */
+static bool sectorBlank(uint32_t offset) {
+    const uint32_t * words = (const uint32_t *)(XIP_BASE + offset);
+    uint16_t i;
+
+    for (i = 0; i < FLASH_SECTOR_SIZE / 4; i++) {
+        if (words[i] != 0xFFFFFFFF)
+            return false;
+    }
+
+    return true;
+}
+
+/* Returns true if the log sector at offset is blank, and can be trusted to
+ * be: see ERASE_CHUNK. */
+static bool sectorErased(uint32_t offset) {
+    return (offset < erasedTo || offset < eraseCheckFrom || offset >= eraseCheckTo)
+        && sectorBlank(offset);
+}
+
+/* Finishes whatever erase is part way through, if any. */
+static void finishErase(void) {
+    while (flash.erasing != W25Q_IDLE) {
+        if (eraseSlice(flash.erasing) < W25Q_OK)
+            break;
+    }
+}
+
+/* Erases the sector at offset and waits for it, unless it's already blank.
+ * Finishes any other erase that's part way through first. */
+static void eraseSector(uint32_t offset) {
+    if (flash.erasing != offset)
+        finishErase();
+
+    if (flash.erasing != offset && sectorErased(offset))
+        return;
+
+    while (eraseSlice(offset) == W25Q_PENDING)
+        tight_loop_contents();
+}
+
+/* True if entry was written whole, rather than being blank or a leftover. */
+static bool entryValid(const struct meta_entry * entry) {
+    return entry->check == ~(entry->epoch | (uint32_t) entry->layout << 16)
+        && entry->epoch < 0xFFFF;
+}
+
+/* True if entry is the current epoch's, in this firmware's layout. */
+static bool entryCurrent(const struct meta_entry * entry) {
+    return entryValid(entry) && entry->epoch == epoch && entry->layout == LOG_LAYOUT;
+}
+
+/* The meta page of the current epoch, straight from flash. */
+static const struct meta_page * currentMeta(void) {
+    return (const struct meta_page *)(XIP_BASE + META_START + metaPage * FLASH_PAGE_SIZE);
+}
+
+/* Programs changes to the current meta page. Only bits that are still set in
+ * flash can be changed, so entries must go from blank to filled in. */
+static void updateMeta(const struct meta_page * meta) {
+    static page_t page;
+
+    memset(page.raw, 0xFF, sizeof(page.raw));
+    memcpy(page.raw, meta, sizeof(*meta));
+    programPage(META_START + metaPage * FLASH_PAGE_SIZE, page.raw);
+}
+
+/* Writes the current epoch to the next meta page. If that's the start of the
+ * other sector, it's erased first. The old epoch stays in this one until the
+ * new one is written. */
+static void writeEpoch(void) {
+    static page_t page;
+    struct meta_entry * entry = (struct meta_entry *) page.raw;
+
+    metaPage = (metaPage + 1) % META_PAGES;
+    if (metaPage % (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE) == 0)
+        eraseSector(META_START + metaPage * FLASH_PAGE_SIZE);
+
+    memset(page.raw, 0xFF, sizeof(page.raw));
+    entry->epoch = epoch;
+    entry->layout = LOG_LAYOUT;
+    entry->check = ~(entry->epoch | (uint32_t) entry->layout << 16);
+    programPage(META_START + metaPage * FLASH_PAGE_SIZE, page.raw);
+}
+
+/* Notes in the meta page each chunk of the log erasedTo has got past. */
+static void markErased(void) {
+    static struct meta_page meta;
+    uint32_t done = (erasedTo - LOG_START) / ERASE_CHUNK;
+    uint64_t erased;
+
+    if (erasedTo < PICO_FLASH_SIZE_BYTES && (erasedTo - LOG_START) % ERASE_CHUNK != 0)
+        return;
+
+    // Nowhere to put it until the epoch has been written.
+    meta = *currentMeta();
+    if (!entryCurrent(&meta.entry))
+        return;
+
+    erased = meta.erased;
+    if (erasedTo >= PICO_FLASH_SIZE_BYTES || done >= ERASE_MARKS)
+        meta.erased = 0;
+    else
+        meta.erased &= ~0ULL << done;
+
+    if (meta.erased != erased)
+        updateMeta(&meta);
+}
+
+/* Number of chunks of the log the meta page says are erased. */
+static uint8_t erasedChunks(void) {
+    const struct meta_page * meta = currentMeta();
+    uint8_t n = 0;
+
+    if (!entryCurrent(&meta->entry))
+        return 0;
+
+    while (n < ERASE_MARKS && !(meta->erased & (1ULL << n)))
+        n++;
+
+    return n;
+}
+
+/* True if epoch a came after b. Epochs wrap from 0xFFFE to 0, so they're
+ * compared as serial numbers: a is newer if it's less than half way round
+ * ahead of b. The meta sectors only hold the last META_PAGES of them. */
+static bool epochAfter(uint32_t a, uint32_t b) {
+    return (int16_t)(uint16_t)(a - b) > 0;
+}
+
+/* Finds the current epoch: the newest one in the meta sectors. If that log
+ * was written in another layout, a new one is started after it, as
+ * clearFlash() would, and the old one is erased as the new one needs it. */
+static void findEpoch(void) {
+    const struct meta_entry * entry;
+    bool found = false;
+    uint16_t i;
+
+    // With no epoch yet, the first one goes at the start, which erases
+    // anything left over there.
+    epoch = 0;
+    metaPage = META_PAGES - 1;
+
+    for (i = 0; i < META_PAGES; i++) {
+        entry = (const struct meta_entry *)(XIP_BASE + META_START + i * FLASH_PAGE_SIZE);
+        if (entryValid(entry) && (!found || epochAfter(entry->epoch, epoch))) {
+            epoch = entry->epoch;
+            metaPage = i;
+            found = true;
+        }
+    }
+
+    if (found && currentMeta()->entry.layout != LOG_LAYOUT) {
+        epoch = epoch + 1 == 0xFFFF ? 0 : epoch + 1;
+        writeEpoch();
+    }
+}
+
+/* Finds where we left off writing in flash.
+ * Pages are programmed in order, so the current log is one unbroken run from
+ * the start; after it is blank flash or stale pages from older logs. We
+ * binary search for the end, which takes ~15 reads instead of one per stored
+ * record.
+ * Only the last page programmed can have been torn by a power cut, so that's
+ * the only one that needs checking. If it's torn, it's left where it is for
+ * the readers to skip. A program cut off before the header made it leaves a
+ * page that looks blank but isn't, so the cursor steps over any of those too,
+ * which can only be in a sector the log has already reached. */
+static void findCursor(void) {
+    const page_t * first = (const page_t *)(XIP_BASE + LOG_START);
+    uint32_t lo = 0;
+    uint32_t hi = (PICO_FLASH_SIZE_BYTES - LOG_START) / FLASH_PAGE_SIZE;
+    uint32_t mid;
+    uint32_t start = time_us_32();
+
+    findEpoch();
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (first[mid].hdr.stream != 0xFF && first[mid].hdr.epoch == epoch)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0 && !pageIntact(lo - 1))
+        tornPages++;
+
+    while (lo % (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE) != 0 && !pageBlank(lo)) {
+        tornPages++;
+        lo++;
+    }
+
+    // If flash is full this points past the end and pages are dropped.
+    flashPage = LOG_START + lo * FLASH_PAGE_SIZE;
+
+    // The cursor's sector was erased before the log reached it, but we can't
+    // tell about the ones after.
+    erasedTo = (flashPage + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    eraseCheckFrom = LOG_START + erasedChunks() * ERASE_CHUNK;
+    eraseCheckTo = eraseCheckFrom + ERASE_CHUNK;
+    cursorTime = time_us_32() - start;
+}
+
+/* Programs the full pages in the staging ring, oldest first. A page that
+ * fails stays staged, and is tried again next time. */
+static void programPages(void) {
+    page_t * page;
+    uint32_t start;
+    uint32_t n;
+    int8_t result;
+
+    if (flashPage == 0) {
+        findCursor();
+    }
+
+    while (stageTail != stageHead) {
+        // Once flash is full, pages are dropped rather than written over
+        // the last one.
+        if (flashPage < PICO_FLASH_SIZE_BYTES) {
+            // eraseAhead() should've got here first, but if it hasn't
+            // the page still needs somewhere blank to go. This also
+            // finishes the erase if eraseAhead() is part way through it.
+            if (flashPage >= erasedTo) {
+                eraseSector(erasedTo);
+                erasedTo += FLASH_SECTOR_SIZE;
+                markErased();
+            }
+
+            // A program that timed out may have landed after all, or only
+            // partly. Either way the page can't be programmed again; a
+            // partial one is left for the readers to skip.
+            n = (flashPage - LOG_START) / FLASH_PAGE_SIZE;
+            if (progRetry && !pageBlank(n)) {
+                progRetry = false;
+                flashPage += FLASH_PAGE_SIZE;
+                if (pageIntact(n))
+                    stageTail = (stageTail + 1) % STAGE_PAGES;
+                continue;
+            }
+
+            page = &stage[stageTail];
+            page->hdr.seq = n;
+            page->hdr.crc = pageCrc(page);
+
+            start = time_us_32();
+            result = programPage(flashPage, page->raw);
+            start = time_us_32() - start;
+            progTime = MAX(progTime, start);
+            progTotal += start;
+            progCount++;
+
+            progRetry = result != W25Q_OK;
+            if (progRetry)
+                break;
+
+            flashPage += FLASH_PAGE_SIZE;
+        }
+
+        stageTail = (stageTail + 1) % STAGE_PAGES;
+    }
+}
+
+/* Erases the next sector ahead of the write cursor, if it needs it.
+ * While logging, this stays ERASE_AHEAD bytes ahead of the cursor; with all
+ * set it carries on until the rest of the flash is blank. Only erases for one
+ * slice a call, so it can be run between other work.
+ * Returns how much of the flash is blank ahead of the log, in percent, or:
+ * ERASE_DONE if it's erased as far as it needs to be.
+ * ERASE_SKIPPED if the next sector was already blank, so wasn't erased.
+ * ERASE_FAILED if the flash didn't take the erase. It's tried again next call. */
+int8_t eraseAhead(bool all) {
+    uint32_t limit;
+    int8_t result;
+
+    if (flashPage == 0) {
+        findCursor();
+    }
+
+    if (flash.erasing == W25Q_IDLE) {
+        limit = all ? PICO_FLASH_SIZE_BYTES : MIN(flashPage + ERASE_AHEAD, PICO_FLASH_SIZE_BYTES);
+        if (erasedTo >= limit)
+            return ERASE_DONE;
+
+        if (sectorErased(erasedTo)) {
+            erasedTo += FLASH_SECTOR_SIZE;
+            markErased();
+            return ERASE_SKIPPED;
+        }
+    }
+
+    result = eraseSlice(erasedTo);
+    if (result == W25Q_OK) {
+        erasedTo += FLASH_SECTOR_SIZE;
+        markErased();
+    } else if (result != W25Q_PENDING)
+        return ERASE_FAILED;
+
+    return (uint64_t)(erasedTo - flashPage) * 100 / (PICO_FLASH_SIZE_BYTES - flashPage);
+}
+
+/* Adds a session starting at the cursor to the directory. If the directory
+ * is full, the records carry on as part of the last session. */
+static void openSession(uint32_t start) {
+    static struct meta_page meta;
+    struct session * s;
+    uint8_t i;
+
+    if (flashPage == 0) {
+        findCursor();
+    }
+
+    sessionOpen = true;
+    session = NO_SESSION;
+    sessionRecords = 0;
+    sessionStreams = 0;
+
+    // A new board has never had an epoch written, so has nowhere to put one.
+    meta = *currentMeta();
+    if (!entryCurrent(&meta.entry)) {
+        writeEpoch();
+        meta = *currentMeta();
+    }
+
+    for (i = 0; i < META_SESSIONS; i++) {
+        if (meta.sessions[i].page == 0xFFFFFFFF)
+            break;
+    }
+
+    if (i == META_SESSIONS)
+        return;
+
+    s = &meta.sessions[i];
+    s->page = (flashPage - LOG_START) / FLASH_PAGE_SIZE;
+    s->start = start;
+    s->accRange = ACCL_RANGE;
+    s->gyroRange = GYRO_RANGE;
+    s->magScale = MAG_SCALE;
+    s->baroOsr = phaseRates[phase].baroOsr;
+    updateMeta(&meta);
+
+    session = i;
+}
+
+/* Fills in the open session's record count and streams, now it's finished. */
+static void closeSession(void) {
+    static struct meta_page meta;
+
+    if (session != NO_SESSION) {
+        meta = *currentMeta();
+        meta.sessions[session].records = sessionRecords;
+        meta.streams[session] = sessionStreams;
+        updateMeta(&meta);
+    }
+
+    sessionOpen = false;
+    session = NO_SESSION;
+}
+
+/* Number of pages in the current log. */
+static uint32_t usedPages(void) {
+    if (flashPage == 0) {
+        findCursor();
+    }
+
+    return (MIN(flashPage, PICO_FLASH_SIZE_BYTES) - LOG_START) / FLASH_PAGE_SIZE;
+}
+
+/* Number of sessions in the directory. */
+static uint8_t sessionCount(void) {
+    const struct meta_page * meta;
+    uint8_t i;
+
+    if (flashPage == 0) {
+        findCursor();
+    }
+
+    meta = currentMeta();
+    if (!entryCurrent(&meta->entry))
+        return 0;
+
+    for (i = 0; i < META_SESSIONS; i++) {
+        if (meta->sessions[i].page == 0xFFFFFFFF)
+            break;
+    }
+
+    return i;
+}
+
+/* Finds the pages from first up to end that session n takes up.
+ * Returns false if there's no such session. */
+static bool sessionPages(uint8_t n, uint32_t * first, uint32_t * end) {
+    const struct session * sessions = currentMeta()->sessions;
+    uint8_t count = sessionCount();
+    uint32_t used = usedPages();
+
+    if (n >= count)
+        return false;
+
+    *end = n + 1 < count ? sessions[n + 1].page : used;
+    *end = MIN(*end, used);
+    *first = MIN(sessions[n].page, *end);
+    return true;
+}
+
+/* The sensor streams with pages in session n, a bit each. A session that was
+ * never closed, or that later ones carried on in once the directory filled
+ * up, could have any of them. */
+static uint8_t sessionStreamMask(uint8_t n) {
+    uint8_t mask = currentMeta()->streams[n];
+
+    if (mask == 0xFF || n == META_SESSIONS - 1)
+        return (1u << SENSOR_COUNT) - 1;
+    return mask;
+}
+
+/* Queues the page at stageHead to be programmed. The session starts with
+ * the first page that makes it to flash. A page that keeps failing holds up
+ * the ones behind it, so once they fill the ring, new pages are dropped and
+ * counted in pagesLost rather than written over staged ones. */
+static void stagePage(void) {
+    page_t * page = &stage[stageHead];
+    uint32_t start;
+
+    if ((stageHead + 1) % STAGE_PAGES == stageTail) {
+        programPages();
+        if ((stageHead + 1) % STAGE_PAGES == stageTail) {
+            pagesLost++;
+            return;
+        }
+    }
+
+    if (!sessionOpen) {
+        memcpy(&start, page->data, 4);
+        openSession(start);
+    }
+
+    if (page->hdr.stream < SENSOR_COUNT) {
+        sessionRecords += page->hdr.count;
+        sessionStreams |= 1u << page->hdr.stream;
+    }
+
+    stageHead = (stageHead + 1) % STAGE_PAGES;
+    programPages();
+}
+
+/* Stages up to n of the pages kept from before launch, oldest first. */
+static void drainPages(uint8_t n) {
+    uint8_t i = (preHead + PRETRIGGER_PAGES - preCount) % PRETRIGGER_PAGES;
+
+    for (; n > 0 && preCount > 0; n--, preCount--) {
+        stage[stageHead] = preRing[i];
+        stagePage();
+        i = (i + 1) % PRETRIGGER_PAGES;
+    }
+}
+
+/* Packs the records in packer into a page of stream, and queues it to be
+ * programmed. Before launch, it goes in preRing instead, over the oldest
+ * page once that's full. Until preRing has drained after launch, it goes
+ * in behind it, so pages still reach flash in order. */
+static void commitPage(enum streams stream, struct packer * packer) {
+    bool queued = holding || preCount > 0;
+    page_t * page;
+
+    if (queued && !holding && preCount == PRETRIGGER_PAGES)
+        drainPages(1);
+    page = queued ? &preRing[preHead] : &stage[stageHead];
 
-    sample.time = to_ms_since_boot(get_absolute_time());
+    TRACE_MARK("commitPage", stream);
+    page->hdr.stream = stream;
+    page->hdr.count = packWrite(packer, page->data);
+    page->hdr.epoch = epoch;
 
-    // The HP203 is slow, so when we ask it for a sample, it responds with the
-    // amount of time it'll take. We'll do other stuff while we wait.
-    i2cStatus = HP203Measure(&hp203, HP203_PRES_TEMP, HP203_OSR_256);
-    if(i2cStatus > HP203_OK) {
-        hp203Ready = make_timeout_time_us(i2cStatus);
+    if (stream < SENSOR_COUNT) {
+        streams[stream].records += page->hdr.count;
+        streams[stream].pages++;
+    }
+
+    if (queued) {
+        preHead = (preHead + 1) % PRETRIGGER_PAGES;
+        preCount = MIN(preCount + 1, PRETRIGGER_PAGES);
     } else {
-        // absolute_time_t is a 64 bit int.
-        // The battery will die before it equals 0 again.
-        hp203Ready = 0;
+        stagePage();
     }
+}
+
+/* Sets the phase, and asks core 1 to change to its rates. The condition for
+ * the next phase starts over. */
+static void setRates(enum flight_phase p) {
+    phase = p;
+    heldSince = UINT32_MAX;
+    wantPhase = p;
+    __sev();
+}
+
+/* Logs an event for the phase, as of time. It's committed straight away, so
+ * the page is there even if the flight ends in a power cut. */
+static void logEvent(uint32_t time) {
+    const struct rates * r = &phaseRates[phase];
+    event_record_t event = {
+        .time = time,
+        .phase = phase,
+        .imuOdr = 1000000 / r->imuPeriod,
+        .magRate = 1000000 / r->magPeriod,
+        .baroOsr = r->baroOsr,
+        .keep = keep
+    };
+
+    packAdd(&eventPacker, &event);
+    commitPage(STREAM_EVENT, &eventPacker);
+}
 
-    // Get data from the IMU
-    i2cStatus = QMIReadData(&qmi, &imu);
-    if(i2cStatus == QMI_OK) {
-        memcpy(sample.accel, imu.accel, 6);
-        memcpy(sample.gyro, imu.gyro, 6);
+/* Moves on to phase p at time, and logs that it did. */
+static void setPhase(enum flight_phase p, uint32_t time) {
+    TRACE_MARK("phase", p);
+    setRates(p);
+    logEvent(time);
+}
+
+/* Returns true once cond has been true for ms up to time. Records from core 1
+ * come in time order for each stream, so only check one stream at a time. */
+static bool held(bool cond, uint32_t time, uint32_t ms) {
+    if (!cond) {
+        heldSince = UINT32_MAX;
+        return false;
     }
 
-    // Get data from the compass
-    i2cStatus = QMCGetMag(&qmc, sample.mag);
+    if (heldSince == UINT32_MAX)
+        heldSince = time;
+
+    return time - heldSince >= ms;
+}
 
-    // Then check the HP203
-    if(hp203Ready != 0) {
-        sleep_until(hp203Ready);
-        i2cStatus = HP203GetData(&hp203, &barometer);
-        sample.pres = barometer.pres;
-        sample.temp = barometer.temp;
+/* Stops keeping pages back, so the ones from before launch go to flash as
+ * getSample() drains them. They start with an event for the pad, so the log
+ * says what rates they were taken at. */
+static void releasePages(void) {
+    uint8_t count = preCount;
+    uint32_t start;
+
+    TRACE_BEGIN("releasePages");
+    holding = false;
+    launched = true;
+
+    // The event goes straight to flash, ahead of the pages it's about.
+    if (count > 0) {
+        memcpy(&start, preRing[(preHead + PRETRIGGER_PAGES - count) % PRETRIGGER_PAGES].data, 4);
+        preCount = 0;
+        logEvent(start);
+        preCount = count;
     }
+    TRACE_END("releasePages");
+}
+
+/* The acceleration in an IMU record, squared to save a square root. Three
+ * full scale axes still fit. */
+static uint32_t accelSquared(const imu_record_t * imu) {
+    uint32_t accel = 0;
+    uint8_t i;
 
-    // Zero this for now. Used to check if where we've written in flash.
-    sample.status = 0;
+    for (i = 0; i < 3; i++)
+        accel += (int32_t) imu->accel[i] * imu->accel[i];
 
-    return sample;
+    return accel;
 }
 
-/* Writes a sample to flash.
- * No longer faffs around with buffering. Just yheets it onto flash. */
-void logSample(sample_t sample) {
-    uint8_t buf[512]; // 2 page buffer
+#define G_SQUARED(g) ((uint32_t)((g) * ACCL_LSB_G) * ((g) * ACCL_LSB_G))
 
-    // Flash is initialised as all 1s, and then can selectively set to 0
-    // Setting our write buffer to all 1s lets us write areas smaller than a page
-    memset(buf, 0xFF, 512);
+/* Works out from a record whether the flight has moved on to its next phase.
+ * Launch and burnout come from the IMU, and apogee and landing from the
+ * barometer. Nothing moves on from the ground or after landing. */
+static void trackPhase(const struct record * rec) {
+    bool within;
 
-    // Skip past written structs:
-    while (writePtr->status != 0xFF && (int) writePtr - XIP_BASE < PICO_FLASH_SIZE_BYTES - 512) {
-        writePtr++;
+    switch (phase) {
+    case PHASE_PAD:
+        if (rec->stream == STREAM_IMU
+            && held(accelSquared(&rec->imu) > G_SQUARED(LAUNCH_G), rec->imu.time, LAUNCH_MS)) {
+            releasePages();
+            minPres = UINT32_MAX;
+            setPhase(PHASE_BOOST, rec->imu.time);
+        }
+        break;
+    case PHASE_BOOST:
+        if (rec->stream == STREAM_IMU
+            && held(accelSquared(&rec->imu) < G_SQUARED(BURNOUT_G), rec->imu.time, BURNOUT_MS))
+            setPhase(PHASE_COAST, rec->imu.time);
+        break;
+    case PHASE_COAST:
+        if (rec->stream != STREAM_BARO)
+            break;
+
+        // Smoothed, so one noisy reading can't set the lowest either.
+        if (minPres == UINT32_MAX)
+            smoothPres = rec->baro.pres;
+        else
+            smoothPres += ((int32_t) rec->baro.pres - (int32_t) smoothPres) / APOGEE_SMOOTH;
+        minPres = MIN(minPres, smoothPres);
+        if (held(smoothPres > minPres + APOGEE_PA, rec->baro.time, APOGEE_MS)) {
+            landedPres = rec->baro.pres;
+            setPhase(PHASE_DESCENT, rec->baro.time);
+        }
+        break;
+    case PHASE_DESCENT:
+        if (rec->stream != STREAM_BARO)
+            break;
+
+        // Compare against where the pressure was when it last settled.
+        within = rec->baro.pres <= landedPres + LANDED_PA && rec->baro.pres + LANDED_PA >= landedPres;
+        if (held(within, rec->baro.time, LANDED_MS))
+            setPhase(PHASE_LANDED, rec->baro.time);
+        else if (!within)
+            landedPres = rec->baro.pres;
+        break;
+    default:
+        break;
     }
+}
 
-    uint32_t addrInPage = ((int) writePtr) % 256;
-    memcpy(buf + addrInPage, &sample, sizeof(sample_t));
+/* Adds a record to the next page of a stream. Once the page can't fit any
+ * more, it's committed and the record starts the next one. */
+static void addRecord(enum streams stream, struct packer * packer, const void * data) {
+    if (!packAdd(packer, data)) {
+        commitPage(stream, packer);
+        packAdd(packer, data);
+    }
+}
 
-    uint32_t ints = save_and_disable_interrupts();
-    uint32_t addrInFlash = ((int) writePtr) - XIP_BASE - addrInPage;
-    flash_range_program(addrInFlash, buf, 512);
-    restore_interrupts(ints);
+/* Logs the bucket at level as a summary record, and empties it. */
+static void logBucket(uint8_t level) {
+    struct bucket * b = &buckets[level];
+    summary_record_t sum;
+    int32_t mmm[CHANNELS][3];   // min, max, mean
+    uint8_t ch;
+    uint8_t i;
+
+    // Which channels belong to which sensor
+    static const uint8_t firstChannel[SENSOR_COUNT + 1] = {
+        [STREAM_IMU] = 0, [STREAM_MAG] = 6, [STREAM_BARO] = 9, [SENSOR_COUNT] = CHANNELS
+    };
+
+    for (i = 0; i < SENSOR_COUNT; i++) {
+        for (ch = firstChannel[i]; ch < firstChannel[i + 1]; ch++) {
+            if (b->count[i] == 0) {
+                mmm[ch][0] = mmm[ch][1] = mmm[ch][2] = lastReading[ch];
+            } else {
+                mmm[ch][0] = b->min[ch];
+                mmm[ch][1] = b->max[ch];
+                mmm[ch][2] = b->sum[ch] / b->count[i];
+            }
+        }
+    }
+
+    sum.time = b->start;
+    sum.level = level;
+    for (i = 0; i < 3; i++) {
+        for (ch = 0; ch < 3; ch++) {
+            sum.accel[ch][i] = mmm[ch][i];
+            sum.gyro[ch][i] = mmm[3 + ch][i];
+            sum.mag[ch][i] = mmm[6 + ch][i];
+        }
+        sum.pres[i] = mmm[9][i];
+        sum.temp[i] = mmm[10][i];
+    }
+
+    for (i = 0; i < SENSOR_COUNT; i++) {
+        sum.records[i] = b->count[i];
+        sum.missed[i] = b->missed[i];
+        sum.late[i] = b->late[i];
+    }
+
+    addRecord(STREAM_SUMMARY, &summaryPackers[level], &sum);
+    resetBucket(b);
+}
+
+/* Adds a record's readings to the summary buckets, logging any buckets it
+ * comes after the end of. */
+static void summarise(const struct record * rec) {
+    static const uint32_t periods[SUMMARY_LEVELS] = SUMMARY_PERIODS;
+    int32_t values[6];
+    struct bucket * b;
+    uint32_t time;
+    uint8_t first;
+    uint8_t count;
+    uint8_t level;
+    uint8_t i;
+
+    switch (rec->stream) {
+    case STREAM_IMU:
+        time = rec->imu.time;
+        for (i = 0; i < 3; i++) {
+            values[i] = rec->imu.accel[i];
+            values[3 + i] = rec->imu.gyro[i];
+        }
+        first = 0;
+        count = 6;
+        break;
+    case STREAM_MAG:
+        time = rec->mag.time;
+        for (i = 0; i < 3; i++)
+            values[i] = rec->mag.mag[i];
+        first = 6;
+        count = 3;
+        break;
+    case STREAM_BARO:
+        time = rec->baro.time;
+        values[0] = rec->baro.pres;
+        values[1] = rec->baro.temp;
+        first = 9;
+        count = 2;
+        break;
+    default:
+        return;
+    }
+
+    for (level = 0; level < SUMMARY_LEVELS; level++) {
+        b = &buckets[level];
+
+        // The streams arrive a little out of order, so a reading from just
+        // before the current bucket goes in it rather than ending it.
+        if (b->start != UINT32_MAX && time >= b->start + periods[level])
+            logBucket(level);
+
+        if (b->start == UINT32_MAX)
+            b->start = time - time % periods[level];
+
+        b->count[rec->stream]++;
+        b->missed[rec->stream] += rec->missed;
+        b->late[rec->stream] = MAX(b->late[rec->stream], rec->late);
+        for (i = 0; i < count; i++) {
+            b->min[first + i] = MIN(b->min[first + i], values[i]);
+            b->max[first + i] = MAX(b->max[first + i], values[i]);
+            b->sum[first + i] += values[i];
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        lastReading[first + i] = values[i];
 }
 
-/* Reads a sample from flash.
- * Returns 0 on success, or 1 on failure. */
-uint8_t readSample (size_t index, sample_t * sample) {
-    sample_t * ptr = (sample_t *)(XIP_BASE + PROG_RESERVED) + index;
-    if(ptr->status == 0xFF) {
+/* How many records of each stream to go by for each one logged, from how
+ * much of the log is left and the phase. Returns 0 if none are. */
+static uint16_t decimation(void) {
+    uint32_t left = PICO_FLASH_SIZE_BYTES - flashPage;
+    uint32_t tier = DECIMATE_FROM;
+    uint16_t n = 1;
+
+    // Nothing's been programmed yet, so the cursor hasn't been found. Before
+    // launch nothing goes to flash anyway, and the ring is worth having whole.
+    if (flashPage == 0 || holding)
         return 1;
-    } else {
-        memcpy(sample, ptr, sizeof(sample_t));
+
+    if (left < LOG_RESERVE)
         return 0;
+
+    if (phase == PHASE_BOOST || phase == PHASE_COAST)
+        return 1;
+
+    while (left < tier && n < DECIMATE_MAX) {
+        n *= 2;
+        tier /= 2;
     }
+
+    return n;
 }
 
+/* Adds a record to the summaries, looks at it for the next phase, and, if
+ * it's one to keep, adds it to the next page of its stream. Records that
+ * aren't kept still count towards the summaries. */
+static void logRecord(const struct record * rec) {
+    // All the record types start at the same place in the union, with the
+    // time first.
+    const void * data = &rec->imu;
+    uint16_t n;
+
+    if (rec->stream >= SENSOR_COUNT)
+        return;
+
+    TRACE_BEGIN("logRecord");
+    if (firstTime == 0)
+        firstTime = time_us_32();
+
+    summarise(rec);
+    trackPhase(rec);
+
+    n = decimation();
+    if (n != keep) {
+        keep = n;
+        logEvent(rec->imu.time);
+    }
+
+    if (keep != 0 && kept[rec->stream]++ % keep == 0)
+        addRecord(rec->stream, &packers[rec->stream], data);
+    TRACE_END("logRecord");
+}
+
+/* The time since boot. time_us_64() lives in flash, so core 1 has its own. */
+static absolute_time_t __not_in_flash_func(now)(void) {
+    uint32_t hi = timer_hw->timerawh;
+    uint32_t lo;
+    uint32_t next;
+
+    // Reread if the high word ticked over while reading the low word.
+    while (true) {
+        lo = timer_hw->timerawl;
+        next = timer_hw->timerawh;
+        if (hi == next)
+            break;
+        hi = next;
+    }
+
+    return from_us_since_boot((uint64_t) hi << 32 | lo);
+}
+
+/* Claims the next free slot in the ring for a record from stream.
+ * Returns NULL, and counts the record as dropped, if the ring is full. */
+static struct record * __not_in_flash_func(claimRecord)(enum streams stream) {
+    struct record * rec;
+
+    if ((ringHead + 1) % RING_RECORDS == ringTail) {
+        streams[stream].dropped++;
+        return NULL;
+    }
+
+    rec = &ring[ringHead];
+    rec->stream = stream;
+    rec->late = streams[stream].late;
+    rec->missed = streams[stream].missed;
+    streams[stream].missed = 0;
+    return rec;
+}
+
+/* Hands the claimed record over to core 0, and wakes it if it's waiting. */
+static void __not_in_flash_func(pushRecord)(void) {
+    __dmb();
+    ringHead = (ringHead + 1) % RING_RECORDS;
+    __sev();
+}
+
+/* Each stream reads its sensor in two halves. start queues the reads on the
+ * I2C queue and returns straight away; once done says they've finished,
+ * finish turns what was read into records and passes them to core 0.
+ * These all run on core 1, from RAM. */
+
+/* Starts draining the IMU's FIFO. */
+static bool __not_in_flash_func(startIMU)(void) {
+    return QMIFifoReadAsync(&qmi, &imuRead, IMU_FIFO) == QMI_OK;
+}
+
+static bool __not_in_flash_func(doneIMU)(void) {
+    return imuRead.result != QMI_PENDING;
+}
+
+/* Changes the compass and barometer over to the rates for wantPhase, as soon
+ * as core 1 sees the phase change, whether or not there's an IMU draining.
+ * The compass's change goes out behind the reads already queued; if the last
+ * change is still going, this waits for the next time round the loop. */
+static void __not_in_flash_func(applyRates)(void) {
+    uint8_t p = wantPhase;
+    const struct rates * r = &phaseRates[p];
+
+    if (ratesXfer[2].status == I2CQ_PENDING)
+        return;
+
+    QMCSetODRXfer(&qmc, &ratesXfer[2], r->magOdr);
+    if (I2CQSubmit(&ratesXfer[2]) != I2CQ_OK)
+        return;
+    TRACE_MARK("applyRates", p);
+
+    streams[STREAM_MAG].period = r->magPeriod;
+    baroOsr = r->baroOsr;
+    baroPeriod = r->baroPeriod;
+    ratesPhase = p;
+}
+
+/* Changes the IMU over to the rates applyRates() last moved to. Its samples
+ * are timed by imuPeriod, so this is done straight after a drain, with the
+ * FIFO (nearly) empty. The changes go out as one chain; if the last change
+ * is still going, this waits for the next drain. */
+static void __not_in_flash_func(applyIMURates)(void) {
+    uint8_t p = ratesPhase;
+    const struct rates * r = &phaseRates[p];
+
+    if (ratesXfer[1].status == I2CQ_PENDING)
+        return;
+
+    QMIAccConfigXfer(&qmi, &ratesXfer[0], r->accOdr, ACCL_RANGE);
+    QMIGyroConfigXfer(&qmi, &ratesXfer[1], r->gyroOdr, GYRO_RANGE);
+    ratesXfer[0].next = &ratesXfer[1];
+
+    if (I2CQSubmit(&ratesXfer[0]) != I2CQ_OK)
+        return;
+    TRACE_MARK("applyIMURates", p);
+
+    imuPeriod = r->imuPeriod;
+    streams[STREAM_IMU].period = r->drainPeriod;
+    imuPhase = p;
+}
+
+/* Makes a record of every sample drained from the IMU's FIFO.
+ * The FIFO doesn't hold timestamps, so they are worked back from when the
+ * drain started; the last sample was taken at most one ODR period before. */
+static void __not_in_flash_func(finishIMU)(void) {
+    static struct qmi_data imu[IMU_FIFO];
+    struct record * rec;
+    uint64_t start = to_us_since_boot(streams[STREAM_IMU].started);
+    int16_t n = QMIFifoParse(&imuRead, imu);
+    int16_t i;
+    uint8_t j;
+
+    for (i = 0; i < n; i++) {
+        if ((rec = claimRecord(STREAM_IMU)) == NULL)
+            continue;
+
+        rec->time = start - (uint32_t)(n - 1 - i) * imuPeriod;
+        for (j = 0; j < 3; j++) {
+            rec->imu.accel[j] = imu[i].accel[j];
+            rec->imu.gyro[j] = imu[i].gyro[j];
+        }
+        pushRecord();
+    }
+
+    if (imuPhase != ratesPhase)
+        applyIMURates();
+}
+
+static bool __not_in_flash_func(startMag)(void) {
+    QMCGetMagXfer(&qmc, &magXfer, magBuf);
+    return I2CQSubmit(&magXfer) == I2CQ_OK;
+}
+
+static bool __not_in_flash_func(doneMag)(void) {
+    return magXfer.status != I2CQ_PENDING;
+}
+
+static void __not_in_flash_func(finishMag)(void) {
+    struct record * rec;
+
+    if (magXfer.status != I2CQ_OK || (rec = claimRecord(STREAM_MAG)) == NULL)
+        return;
+
+    rec->time = to_us_since_boot(streams[STREAM_MAG].started);
+    QMCParseMag(magBuf, rec->mag.mag);
+    pushRecord();
+}
+
+/* The barometer takes milliseconds to do a conversion, so rather than wait for
+ * it, each poll picks up the finished conversion and starts the next one,
+ * in one chain of transfers. */
+static bool __not_in_flash_func(startBaro)(void) {
+    HP203GetDataXfer(&hp203, &baroXfer[0], baroBuf);
+    convOsr = baroOsr;
+    HP203MeasureXfer(&hp203, &baroXfer[1], HP203_PRES_TEMP, convOsr);
+    baroXfer[0].next = &baroXfer[1];
+
+    if (converting)
+        TRACE_ASYNC_END("HP203 conversion", convOsr);
+
+    return I2CQSubmit(converting ? &baroXfer[0] : &baroXfer[1]) == I2CQ_OK;
+}
+
+static bool __not_in_flash_func(doneBaro)(void) {
+    return baroXfer[1].status != I2CQ_PENDING;
+}
+
+/* Records the conversion that was picked up, then schedules the next poll for
+ * when the new one will be done, or baroPeriod from now if that's later. */
+static void __not_in_flash_func(finishBaro)(void) {
+    struct record * rec;
+    struct hp203_data barometer;
+
+    if (converting && baroXfer[0].status == I2CQ_OK
+        && (rec = claimRecord(STREAM_BARO)) != NULL) {
+        HP203ParseData(baroBuf, &barometer);
+        rec->time = convStart;
+        rec->baro.pres = barometer.pres;
+        rec->baro.temp = barometer.temp;
+        pushRecord();
+    }
+
+    // The new conversion started at some point before now.
+    convStart = to_us_since_boot(now());
+    converting = baroXfer[1].status == I2CQ_OK;
+
+    if (converting) {
+        TRACE_ASYNC_BEGIN("HP203 conversion", convOsr);
+        streams[STREAM_BARO].period = MAX(HP203MeasureTime(HP203_PRES_TEMP, convOsr), baroPeriod);
+    }
+
+    // If it didn't respond, try again after what a conversion would've taken.
+    streams[STREAM_BARO].next = delayed_by_us(now(), streams[STREAM_BARO].period);
+}
+
+/* Each stream's halves, as run by startPolls() and finishPolls(). */
+static const struct {
+    bool (* start)(void);
+    bool (* done)(void);
+    void (* finish)(void);
+} __not_in_flash("acquire") poll[SENSOR_COUNT] = {
+    [STREAM_IMU]  = { startIMU,  doneIMU,  finishIMU },
+    [STREAM_MAG]  = { startMag,  doneMag,  finishMag },
+    [STREAM_BARO] = { startBaro, doneBaro, finishBaro }
+};
+
+/* Starts the polls that are due. Interrupts must be off, as this runs from
+ * the alarm's interrupt as well as core 1's loop.
+ * Returns the time the next one is due. */
+static absolute_time_t __not_in_flash_func(startPolls)(void) {
+    struct stream * s;
+    absolute_time_t next = at_the_end_of_time;
+    int64_t late;
+    uint8_t i;
+
+    for(i = 0; i < SENSOR_COUNT; i++) {
+        s = &streams[i];
+        late = absolute_time_diff_us(s->next, now());
+
+        if (!s->busy && late >= 0) {
+            s->started = now();
+            s->busy = poll[i].start();
+            if (s->busy)
+                TRACE_ASYNC_BEGIN(s->name, i);
+
+            s->polls++;
+            s->maxLate = MAX(s->maxLate, (uint32_t) late);
+            s->late = MIN(late, UINT16_MAX);
+            s->jitter[MIN((uint32_t) late >> JITTER_SHIFT, JITTER_BUCKETS - 1)]++;
+            if (flashBusy)
+                s->maxFlashLate = MAX(s->maxFlashLate, (uint32_t) late);
+
+            // Stay on the original schedule. If we've fallen a whole period
+            // behind, skip the polls we missed rather than bunching them up.
+            // Paced streams are rescheduled when they finish.
+            if (!s->paced) {
+                s->next = delayed_by_us(s->next, s->period);
+                while (absolute_time_diff_us(s->next, now()) >= 0) {
+                    s->next = delayed_by_us(s->next, s->period);
+                    s->overruns++;
+                    s->missed++;
+                }
+            } else if (!s->busy) {
+                s->next = delayed_by_us(now(), s->period);
+            }
+        }
+
+        if (!s->busy && absolute_time_diff_us(s->next, next) > 0)
+            next = s->next;
+    }
+
+    return next;
+}
+
+/* Starts the polls that are due, and sets the alarm for the next one. The
+ * alarm only matches the low 32 bits of the timer, so if that's passed by the
+ * time it's set, it'd go off 71 minutes late; start it now instead. With
+ * every stream busy there's nothing to set it for, and core 1's loop sets it
+ * again once one finishes. Interrupts must be off. */
+static void __not_in_flash_func(armPolls)(void) {
+    absolute_time_t next;
+
+    do {
+        next = startPolls();
+        if (is_at_the_end_of_time(next))
+            break;
+        timer_hw->alarm[acqAlarm] = (uint32_t) to_us_since_boot(next);
+    } while (absolute_time_diff_us(now(), next) <= 0);
+}
+
+/* Polls start from the alarm's interrupt rather than core 1's loop, so they
+ * go out on time even while the loop is part way through finishing another
+ * stream's reads. */
+static void __not_in_flash_func(acqAlarmIrq)(void) {
+    timer_hw->intr = 1u << acqAlarm;
+    armPolls();
+}
+
+/* Turns the reads that are done into records for core 0. The alarm can
+ * interrupt a finish to start another stream's poll, but never one that's
+ * still busy, so the stream is only handed back with interrupts off. */
+static void __not_in_flash_func(finishPolls)(void) {
+    struct stream * s;
+    int64_t busy;
+    uint32_t ints;
+    uint8_t i;
+
+    for(i = 0; i < SENSOR_COUNT; i++) {
+        s = &streams[i];
+
+        if (s->busy && poll[i].done()) {
+            TRACE_ASYNC_END(s->name, i);
+            TRACE_BEGIN("finish");
+            poll[i].finish();
+            TRACE_END("finish");
+
+            ints = save_and_disable_interrupts();
+            s->busy = false;
+            busy = absolute_time_diff_us(s->started, now());
+            s->maxBusy = MAX(s->maxBusy, busy);
+            s->totalBusy += busy;
+            restore_interrupts(ints);
+        }
+    }
+}
+
+/* Core 1's main loop. Owns the I2C bus and all the sensor timing, and never
+ * touches flash. Polls are started by the alarm, and their reads finish with
+ * an interrupt, which wakes the loop to turn them into records. */
+static void __not_in_flash_func(acquire)(void) {
+    uint32_t ints;
+
+    // Setting up can run from flash, as core 0 waits for us.
+    I2CQInit(i2c_default);
+
+    acqAlarm = hardware_alarm_claim_unused(true);
+    irq_set_exclusive_handler(TIMER_IRQ_0 + acqAlarm, acqAlarmIrq);
+    hw_set_bits(&timer_hw->inte, 1u << acqAlarm);
+    irq_set_enabled(TIMER_IRQ_0 + acqAlarm, true);
+
+    multicore_fifo_push_blocking(0);
+
+    while (true) {
+        finishPolls();
+
+        if (wantPhase != ratesPhase)
+            applyRates();
+
+        // A stream that's just finished may already be due again.
+        ints = save_and_disable_interrupts();
+        armPolls();
+        restore_interrupts(ints);
+
+        __wfe();
+    }
+}
+
+/* Takes the records core 1 has made since the last call and applies them to
+ * sample, and logs them as set by mode.
+ * No longer attempts to determine if sensors are functional.
+ * If they don't respond, they dont respond.
+ * Returns the latest time worth waiting until for more. Core 1 wakes us up if
+ * they come sooner, so wait with best_effort_wfe_or_timeout(). */
+absolute_time_t getSample(sample_t * sample, enum log_mode mode) {
+    struct record * rec;
+    // Only traced when there's something to do, or the idle loops fill the
+    // ring in no time.
+    bool traced = ringTail != ringHead;
+
+    if (traced)
+        TRACE_BEGIN("getSample");
+    holding = mode == LOG_LAUNCH && !launched;
+    if (holding && phase == PHASE_GROUND)
+        setRates(PHASE_PAD);
+    if (!holding && !launched && preCount > 0)
+        releasePages();
+    if (!holding)
+        drainPages(RELEASE_PAGES);
+
+    while (ringTail != ringHead) {
+        __dmb();
+        rec = &ring[ringTail];
+
+        sample->status = rec->stream | (rec->missed ? SAMPLE_MISSED : 0);
+        sample->micros = rec->time;
+        switch (rec->stream) {
+        case STREAM_IMU:
+            rec->imu.time = rec->time / 1000;
+            rec->imu.missed = rec->missed;
+            sample->time = rec->imu.time;
+            memcpy(sample->accel, rec->imu.accel, 6);
+            memcpy(sample->gyro, rec->imu.gyro, 6);
+            break;
+        case STREAM_MAG:
+            rec->mag.time = rec->time / 1000;
+            rec->mag.missed = rec->missed;
+            sample->time = rec->mag.time;
+            memcpy(sample->mag, rec->mag.mag, 6);
+            break;
+        case STREAM_BARO:
+            rec->baro.time = rec->time / 1000;
+            rec->baro.missed = rec->missed;
+            sample->time = rec->baro.time;
+            sample->pres = rec->baro.pres;
+            sample->temp = rec->baro.temp;
+            break;
+        }
+
+        if (mode != LOG_NONE)
+            logRecord(rec);
+
+        __dmb();
+        ringTail = (ringTail + 1) % RING_RECORDS;
+    }
+
+    if (traced)
+        TRACE_END("getSample");
+    return make_timeout_time_us(streams[STREAM_IMU].period);
+}
+
+/* Programs any partially filled pages to flash.
+ * Call this before you stop logging, or the last few records are lost. */
+void flushSamples(void) {
+    uint8_t i;
+
+    TRACE_BEGIN("flushSamples");
+    for(i = 0; i < SENSOR_COUNT; i++) {
+        if (packers[i].count > 0)
+            commitPage(i, &packers[i]);
+    }
+
+    // The last buckets are cut short, but they're still worth having.
+    for(i = 0; i < SUMMARY_LEVELS; i++) {
+        if (buckets[i].start != UINT32_MAX)
+            logBucket(i);
+        if (summaryPackers[i].count > 0)
+            commitPage(STREAM_SUMMARY, &summaryPackers[i]);
+    }
+
+    // Launched, so whatever's left of preRing goes too. Otherwise none of it
+    // was worth keeping.
+    if (!holding)
+        drainPages(PRETRIGGER_PAGES);
+    preCount = 0;
+    holding = false;
+    launched = false;
+
+    // The next session starts out keeping everything, or says it isn't.
+    keep = 1;
+    memset(kept, 0, sizeof(kept));
+
+    if (sessionOpen)
+        closeSession();
+
+    // Back to the ground rates until the next time.
+    setRates(PHASE_GROUND);
+    TRACE_END("flushSamples");
+}
+
+/* Points cursor at the start of the log, to read all of it. */
+void seekLog(struct log_cursor * cursor) {
+    cursor->page = 0;
+    cursor->record = 0;
+    cursor->end = UINT32_MAX;
+    cursor->from = 0;
+    cursor->to = UINT32_MAX;
+}
+
+/* Time of the first record in a page. It's the first column of every
+ * layout, so it's stored as is at the start of the data, and each page
+ * header works as an index entry without unpacking anything. */
+static uint32_t pageTime(uint32_t n) {
+    const page_t * page = (const page_t *)(XIP_BASE + LOG_START) + n;
+    uint32_t time;
+
+    memcpy(&time, page->data, 4);
+    return time;
+}
+
+static uint8_t pageStream(uint32_t n) {
+    return ((const page_t *)(XIP_BASE + LOG_START))[n].hdr.stream;
+}
+
+/* Points cursor at the records in session n (or the latest, if n is
+ * SESSION_LATEST) from time from up to time to, in ms since boot.
+ * Streams are paged separately, so a page can start well before the pages
+ * either side of it, and only one stream's pages are in time order. The
+ * first stream the session has (the IMU, if it's there) is binary searched
+ * for from, then the search walks back until every stream in the session has
+ * a page starting no later than from, as nothing before that can be in
+ * range. The end is found the same way going forward.
+ * Each probe reads headers from the middle on to the next page of the
+ * searched stream, but no further than what's left to search, so the search
+ * costs ~log2(pages) probes of up to the gap between that stream's pages.
+ * The walks cost the headers back to the start of the sparsest stream's
+ * page, and on past to, so reading a range costs those plus the pages in it.
+ * Returns false if there's no such session. */
+bool seekTime(struct log_cursor * cursor, uint8_t n, uint32_t from, uint32_t to) {
+    uint8_t streams;
+    uint8_t lead;
+    uint8_t left;
+    uint32_t first;
+    uint32_t end;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+    uint32_t i;
+
+    if (n == SESSION_LATEST)
+        n = sessionCount() - 1;
+
+    if (!sessionPages(n, &first, &end))
+        return false;
+
+    // Waiting on a stream the session doesn't have would walk all of it.
+    streams = sessionStreamMask(n);
+    for (lead = 0; lead < SENSOR_COUNT - 1 && !(streams & (1u << lead)); lead++)
+        ;
+
+    // Find the first lead page starting at or after from. Each probe lands
+    // on the first lead page from mid onwards. If there isn't one before hi,
+    // it's the one at hi, which is already known not to start before from.
+    lo = first;
+    hi = end;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        for (i = mid; i < hi && pageStream(i) != lead; i++)
+            ;
+
+        if (i < hi && pageTime(i) < from)
+            lo = i + 1;
+        else
+            hi = mid;
+    }
+
+    // Walk back until each stream has started a page before from.
+    left = streams;
+    cursor->page = first;
+    for (i = MIN(lo + 1, end); i > first && left != 0; i--) {
+        if (pageStream(i - 1) < SENSOR_COUNT && (left & (1u << pageStream(i - 1)))
+            && pageTime(i - 1) < from) {
+            left &= ~(1u << pageStream(i - 1));
+            cursor->page = i - 1;
+        }
+    }
+
+    if (left != 0)
+        cursor->page = first;
+
+    // Walk forward until each stream has started a page after to.
+    left = streams;
+    for (i = cursor->page; i < end && left != 0; i++) {
+        if (pageStream(i) < SENSOR_COUNT && (left & (1u << pageStream(i))) && pageTime(i) > to)
+            left &= ~(1u << pageStream(i));
+    }
+
+    cursor->end = left != 0 ? end : i;
+    cursor->record = 0;
+    cursor->from = from;
+    cursor->to = to;
+    return true;
+}
+
+/* Reads the record at cursor from flash and applies it to sample,
+ * then moves cursor on to the next record.
+ * Returns 0 on success, or 1 if there are no more records. */
+uint8_t readSample(struct log_cursor * cursor, sample_t * sample) {
+    const page_t * page;
+    uint32_t time;
+    uint8_t i;
+
+    do {
+        while (true) {
+            if (cursor->page >= MIN(cursor->end, usedPages()))
+                return 1;
+
+            page = (const page_t *)(XIP_BASE + LOG_START) + cursor->page;
+
+            // Torn pages are skipped whole.
+            if (cursor->record < page->hdr.count && page->hdr.stream < SENSOR_COUNT
+                && (readPage == cursor->page || pageIntact(cursor->page)))
+                break;
+
+            cursor->page++;
+            cursor->record = 0;
+        }
+
+        // Pages have to be unpacked as a whole, so keep the last one around.
+        if (readPage != cursor->page) {
+            unpack(&layouts[page->hdr.stream], page->data, page->hdr.count, &readRecords);
+            readPage = cursor->page;
+        }
+
+        // Every record starts with its time.
+        i = cursor->record++;
+        memcpy(&time, (const uint8_t *) &readRecords + i * layouts[page->hdr.stream].size, 4);
+    } while (time < cursor->from || time > cursor->to);
+
+    sample->status = page->hdr.stream;
+    sample->time = time;
+    sample->micros = (uint64_t) time * 1000;
+
+    switch (page->hdr.stream) {
+    case STREAM_IMU:
+        memcpy(sample->accel, readRecords.imu[i].accel, 6);
+        memcpy(sample->gyro, readRecords.imu[i].gyro, 6);
+        if (readRecords.imu[i].missed)
+            sample->status |= SAMPLE_MISSED;
+        break;
+    case STREAM_MAG:
+        memcpy(sample->mag, readRecords.mag[i].mag, 6);
+        if (readRecords.mag[i].missed)
+            sample->status |= SAMPLE_MISSED;
+        break;
+    case STREAM_BARO:
+        sample->pres = readRecords.baro[i].pres;
+        sample->temp = readRecords.baro[i].temp;
+        if (readRecords.baro[i].missed)
+            sample->status |= SAMPLE_MISSED;
+        break;
+    }
+
+    return 0;
+}
+
+/* Header of each frame sent by dumpFlash(). The frame is followed by pages
+ * whole pages, then a CRC32 of the header and pages. */
+struct dump_hdr {
+    uint32_t magic;
+    uint32_t page;    // Index of the first page, from the start of the log
+    uint16_t pages;   // Number of pages in the frame. 0 marks the end.
+    uint16_t layout;  // LOG_LAYOUT, so a decoder for another can refuse it
+};
+
+/* Adds up the record counts in the headers of pages first up to end. */
+static uint32_t countRecords(uint32_t first, uint32_t end) {
+    const page_t * log = (const page_t *)(XIP_BASE + LOG_START);
+    uint32_t records = 0;
+
+    for (; first < end; first++) {
+        if (log[first].hdr.stream < SENSOR_COUNT && log[first].hdr.epoch == epoch)
+            records += log[first].hdr.count;
+    }
+
+    return records;
+}
+
+/* Prints the summaries of session n (or the latest, if n is SESSION_LATEST)
+ * at level, as CSV: the bucket's start time, then the min, max and mean of
+ * each channel in the same order as 'r'. Only the page headers of the rest of
+ * the session are read.
+ * Returns false if there's no such session. */
+bool previewSession(uint8_t n, uint8_t level) {
+    static summary_record_t sums[SUMMARY_RECORDS];
+    const page_t * log = (const page_t *)(XIP_BASE + LOG_START);
+    const summary_record_t * s;
+    uint32_t first;
+    uint32_t end;
+    uint8_t i;
+    uint8_t j;
+
+    if (n == SESSION_LATEST)
+        n = sessionCount() - 1;
+
+    if (!sessionPages(n, &first, &end))
+        return false;
+
+    printf("time, pres min, max, mean, temp min, max, mean, "
+           "mag x min, max, mean, y..., z..., accel x min, max, mean, y..., z..., "
+           "gyro x min, max, mean, y..., z..., "
+           "IMU records, missed, late us, compass..., baro...\n");
+
+    for (; first < end; first++) {
+        if (log[first].hdr.stream != STREAM_SUMMARY || log[first].hdr.count > SUMMARY_RECORDS)
+            continue;
+
+        // Each level has its own pages, so only the first record's level
+        // needs checking, which is stored as is straight after its time.
+        // Torn pages are skipped.
+        if (log[first].data[4] != level || !pageIntact(first))
+            continue;
+
+        unpack(&layouts[STREAM_SUMMARY], log[first].data, log[first].hdr.count, sums);
+
+        for (i = 0; i < log[first].hdr.count; i++) {
+            s = &sums[i];
+            printf("%u, %u, %u, %u, %d, %d, %d", s->time,
+                   s->pres[0], s->pres[1], s->pres[2],
+                   s->temp[0], s->temp[1], s->temp[2]);
+            for (j = 0; j < 3; j++)
+                printf(", %d, %d, %d", s->mag[j][0], s->mag[j][1], s->mag[j][2]);
+            for (j = 0; j < 3; j++)
+                printf(", %d, %d, %d", s->accel[j][0], s->accel[j][1], s->accel[j][2]);
+            for (j = 0; j < 3; j++)
+                printf(", %d, %d, %d", s->gyro[j][0], s->gyro[j][1], s->gyro[j][2]);
+            for (j = 0; j < SENSOR_COUNT; j++)
+                printf(", %u, %u, %u", s->records[j], s->missed[j], s->late[j]);
+            printf("\n");
+        }
+    }
+
+    return true;
+}
+
+/* Prints the session directory. */
+void listSessions(void) {
+    const struct session * s;
+    uint8_t count = sessionCount();
+    uint32_t records;
+    uint32_t first;
+    uint32_t end;
+    uint8_t i;
+
+    printf("%-7s %10s %7s %9s %10s %5s %5s %5s %5s\n",
+           "Session", "First page", "Pages", "Records", "Start ms",
+           "Accel", "Gyro", "Mag", "OSR");
+
+    for (i = 0; i < count; i++) {
+        s = &currentMeta()->sessions[i];
+        sessionPages(i, &first, &end);
+
+        // Never closed, or carried on past its close when the directory
+        // filled up, so count them the slow way.
+        records = s->records;
+        if (records == 0xFFFFFFFF || i == META_SESSIONS - 1)
+            records = countRecords(first, end);
+
+        printf("%-7x %10u %7u %9u %10u %5u %5u %5u %5u\n",
+               i, first, end - first, records, s->start,
+               s->accRange, s->gyroRange, s->magScale, s->baroOsr);
+    }
+
+    if (count == META_SESSIONS)
+        printf("The directory is full, so anything since is part of the last session.\n");
+}
+
+/* Sends pages first up to end of the log over USB as binary frames, for
+ * drivers/dumpData.py to decode. Pages are sent straight from flash, and
+ * bypass printf so nothing gets translated. */
+static void dumpPages(uint32_t first, uint32_t end) {
+    const uint8_t * log = (const uint8_t *)(XIP_BASE + LOG_START);
+    struct dump_hdr hdr = { .magic = DUMP_MAGIC, .page = first, .layout = LOG_LAYOUT };
+    const uint8_t * data;
+    uint32_t crc;
+
+    do {
+        hdr.pages = MIN(end - hdr.page, DUMP_PAGES);
+        data = log + hdr.page * FLASH_PAGE_SIZE;
+
+        crc = crc32(0, (const uint8_t *) &hdr, sizeof(hdr));
+        crc = crc32(crc, data, hdr.pages * FLASH_PAGE_SIZE);
+
+        stdio_usb.out_chars((const char *) &hdr, sizeof(hdr));
+        stdio_usb.out_chars((const char *) data, hdr.pages * FLASH_PAGE_SIZE);
+        stdio_usb.out_chars((const char *) &crc, sizeof(crc));
+
+        hdr.page += hdr.pages;
+    } while (hdr.pages > 0);
+
+    stdio_flush();
+}
+
+/* Sends every page in the log over USB as binary frames, for
+ * drivers/dumpData.py to decode. */
+void dumpFlash(void) {
+    dumpPages(0, usedPages());
+}
+
+/* Sends just the pages of session n, or the latest one if n is
+ * SESSION_LATEST, in the same frames as dumpFlash(). Costs time in
+ * proportion to the session, however much else is in the log.
+ * If there's no such session, only the end frame is sent.
+ * Returns false if there's no such session. */
+bool dumpSession(uint8_t n) {
+    uint32_t first = 0;
+    uint32_t end = 0;
+    bool found;
+
+    if (n == SESSION_LATEST)
+        n = sessionCount() - 1;
+
+    found = sessionPages(n, &first, &end);
+    dumpPages(first, end);
+    return found;
+}
+
+/* Starts a new log. Returns straight away; the old log is erased bit by bit
+ * by eraseAhead(). */
 void clearFlash(void) {
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(PROG_RESERVED, 7*1024*1024);
-    restore_interrupts(ints);
-    writePtr = (sample_t *)(XIP_BASE + PROG_RESERVED);
+    if (flashPage == 0) {
+        findCursor();
+    }
+
+    // 0xFFFF is what a blank page header reads as, so skip it.
+    epoch++;
+    if (epoch == 0xFFFF)
+        epoch = 0;
+
+    // The erase ahead is for the old log, which is about to be forgotten.
+    finishErase();
+
+    // The new log starts with an empty session directory.
+    writeEpoch();
+
+    // Anything still staged belonged to the old log.
+    resetPackers();
+    sessionOpen = false;
+    session = NO_SESSION;
+    stageHead = stageTail = 0;
+    readPage = UINT32_MAX;
+    flashPage = LOG_START;
+    erasedTo = LOG_START;
+    progRetry = false;
 }